@@ -28,7 +28,7 @@ namespace Durations {
 
 
 namespace InternalParam {
-    const int64 stateInfoFormatVersion = 7; // Used to judge the validity of the state information stored/restored to/from the host. For non-backward compatible state information strucure change, increment it.
+    const int64 stateInfoFormatVersion = 10; // Used to judge the validity of the state information stored/restored to/from the host. For non-backward compatible state information strucure change, increment it.
     const int _controlAreaWidth = 120;
     const int _hoffset = 12;
     const int _voffset = 8;
@@ -49,6 +49,8 @@ namespace InternalParam {
 
     const int nobTitleFontSize = 11;
 
+    const int maxUndoSteps = 500; // Older history is discarded
+
     const double defaultTempo = 100.0;
 };
 
@@ -63,5 +65,8 @@ namespace ColourParam {
     const Colour loopEndIndColor   = Colours::grey.darker().darker().darker().darker();
     const Colour labelColour       = Colours::lightgrey;
     const Colour upViewBoundColour = Colours::grey.darker().darker();
+    const Colour mutedLaneOverlay  = Colours::black.withAlpha((float)0.5);
+    const Colour soloLaneMarker    = Colours::yellow.withAlpha((float)0.15);
+    const Colour laneGridLine      = Colours::yellow.withAlpha((float)0.4);
 };
 
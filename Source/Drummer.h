@@ -13,7 +13,11 @@
 #include <JuceHeader.h>
 #include "Common.h"
 #include "Helper.h"
+#include "SeqStorage.h"
 #include <set>
+#include <array>
+#include <deque>
+#include <unordered_map>
 #include <shared_mutex>
 
 class DrunkerProcessor; // Do not include Drunker.h
@@ -23,10 +27,76 @@ protected:
     float _fs;
     std::atomic_int64_t _time;
     
+    // Lookahead(pre-roll) used by the scheduler, which shall always equal to the latency reported to the host.
+    std::atomic<int> _lookaheadSamples;
+    // Lookahead needed to cover the negative nudge at the current tempo. 0 when lookahead mode is off.
+    std::atomic<int> _requiredLookaheadSamples;
+    
+    // Transport snapshot published by processBlock for the playhead drawing. Fields are consistent by the sequence counter (odd while writing).
+    std::atomic<uint32> _playheadSeq;
+    std::atomic<int64> _playheadTime;
+    std::atomic<double> _playheadBpm;
+    std::atomic<double> _playheadStampMs;
+    std::atomic<bool> _playheadRunning;
+    std::atomic<bool> _playheadRunningChanged; // Set by the audio thread, cleared by dispatchPlayheadChange
+    
+    // Called in the message thread when the transport starts or stops, so that the GUI needs no polling while stopped.
+    std::list< std::function<void(bool)> > _playheadCbs;
+    
+    // Audio thread. Time is the sample time at the start of the block, and the time stamp is now.
+    void publishPlayhead(int64 timeInSamples, double bpm, bool running){
+        if(running != _playheadRunning.load(std::memory_order_relaxed)) _playheadRunningChanged.store(true);
+        _playheadSeq.fetch_add(1, std::memory_order_acq_rel);
+        _playheadTime.store(timeInSamples, std::memory_order_relaxed);
+        _playheadBpm.store(bpm, std::memory_order_relaxed);
+        _playheadStampMs.store(Time::getMillisecondCounterHiRes(), std::memory_order_relaxed);
+        _playheadRunning.store(running, std::memory_order_relaxed);
+        _playheadSeq.fetch_add(1, std::memory_order_release);
+    }
+    
 public:
     
     virtual Duration getLocalTimeInDuration() const = 0;
     
+    struct PlayheadSnapshot{
+        int64 _timeInSamples;
+        double _bpm;
+        double _stampMs;
+        bool _running;
+    };
+    // Lock free, wait free for the audio thread. Retried only if processBlock is publishing at the moment.
+    PlayheadSnapshot getPlayhead() const {
+        PlayheadSnapshot ps;
+        for(;;){
+            uint32 seq = _playheadSeq.load(std::memory_order_acquire);
+            if(seq & 1) continue;
+            ps._timeInSamples = _playheadTime.load(std::memory_order_relaxed);
+            ps._bpm = _playheadBpm.load(std::memory_order_relaxed);
+            ps._stampMs = _playheadStampMs.load(std::memory_order_relaxed);
+            ps._running = _playheadRunning.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(_playheadSeq.load(std::memory_order_relaxed) == seq) return ps;
+        }
+    }
+    
+    bool isPlayheadRunning() const { return _playheadRunning.load(); }
+    bool isPlayheadChangePending() const { return _playheadRunningChanged.load(); }
+    
+    void addPlayheadCallback(std::function<void(bool)> cb){
+        _playheadCbs.push_back(cb);
+    }
+    // Message thread.
+    void dispatchPlayheadChange(){
+        if(!_playheadRunningChanged.exchange(false)) return;
+        bool running = isPlayheadRunning();
+        for(auto cb : _playheadCbs){
+            cb(running);
+        }
+    }
+    
+    // Position of the playhead in the loop at nowMs (Time::getMillisecondCounterHiRes()), extrapolated from the last snapshot.
+    virtual Duration getPlayheadInDuration(double nowMs) const = 0;
+    
     struct DrumMap{
         int bs;
         int snare;
@@ -41,7 +111,8 @@ public:
         virtual ~Pattern(){};
     };
     
-    Drummer()  : _fs(0), _time(0) {}
+    Drummer()  : _fs(0), _time(0), _lookaheadSamples(0), _requiredLookaheadSamples(0),
+                 _playheadSeq(0), _playheadTime(0), _playheadBpm(120.0), _playheadStampMs(0), _playheadRunning(false), _playheadRunningChanged(false) {}
     virtual ~Drummer(){}
     
     virtual void prepareToPlay (double sampleRate){
@@ -64,10 +135,37 @@ public:
         return static_cast<Duration>(samples * bpm * Durations::BEAT4 / _fs / 60);
     }
     
+    // Samples needed to schedule a note nudged by InternalParam::minNudge ahead of its grid position.
+    int lookaheadSamplesFor(double bpm) const {
+        return static_cast<int>(asSamples(-InternalParam::minNudge*Durations::TICK, bpm)) + 1;
+    }
+    
+    // Reported lookahead is rounded up to this, plus this much headroom, so that a tempo ramp does not renegotiate the latency on every block.
+    static const int lookaheadQuantum = 512;
+    static int withLookaheadHeadroom(int required){
+        return required > 0 ? (required / lookaheadQuantum + 2) * lookaheadQuantum : 0;
+    }
+    
+    /**
+     * Lookahead is applied only after the processor reports it to the host as latency (on the message thread).
+     * Returns true if the currently applied one no longer fits, i.e. the headroom is used up. Shrinking is done only when it is less than half, to avoid the frequent latency change by tempo automation.
+     */
+    bool isLookaheadUpdateNeeded() const {
+        int required = _requiredLookaheadSamples.load();
+        int current = _lookaheadSamples.load();
+        return required > current || withLookaheadHeadroom(required) < current/2;
+    }
+    // Lookahead to be reported and applied, incl. the headroom.
+    int getRequiredLookaheadSamples() const { return withLookaheadHeadroom(_requiredLookaheadSamples.load()); }
+    void setLookaheadSamples(int samples){ _lookaheadSamples.store(samples); }
+    
     virtual File exportMidiFile() = 0;
     
     virtual void clearContextInfo() = 0;
     
+    // Message thread. Commits the notes recorded by the audio thread since the last call.
+    virtual void commitRecorded() = 0;
+    
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (Drummer)
 };
 
@@ -78,28 +176,160 @@ class SequenceDrummer : public Drummer
 public:
 
 
-    struct SequenceEntry{
-        int _note;
-        Duration _pos;
-        Duration _nudge; // Slight timing variance less than 64-th note. _pos shall always include this value(hence it represetns the actual timing of the note), while _nudge is the separated info to judge the on-grid / off-grid property. _pos - _nudge is the value used for on-grid/off-grid property.
-        Duration _duration;
-        uint8 _vel;
+    typedef ::SequenceEntry SequenceEntry;
+    typedef ::NoteHandle NoteHandle;
+    typedef ::SeqStorage SeqStorage;
+    typedef ::NoteQuery NoteQuery;
+    
+    /**
+     * What has changed since the last notification, passed to the listeners of SequenceDrummer,
+     * so that they can update their caches and invalidate only the affected regions instead of recomputing everything.
+     * Changes are accumulated until notified, and the updates of the same note are merged (first before, last after).
+     */
+    struct ChangeSet{
+        enum Kind{
+            NOTES = 1,
+            SELECTION = 2,
+            LENGTH = 4,
+            GRID = 8,
+            RESET = 16 // Replaced as a whole (e.g. deserialize). No detail is given.
+        };
+        int _kinds = 0;
+        SeqDelta _notes; // INSERTED : added, ERASED : removed, UPDATED : moved / resized / velocity changed, with the extents before and after
+        std::vector<NoteHandle> _selected; // Selection delta. Toggled handle can be in both.
+        std::vector<NoteHandle> _unselected;
+        Duration _oldLength = 0; // Valid if LENGTH
+        Duration _newLength = 0;
         
-        bool operator<(const SequenceEntry& rh) const {
-            return _pos < rh._pos;
+        bool has(int kinds) const { return (_kinds & kinds) != 0; }
+        bool empty() const { return _kinds == 0; }
+        
+        // Forward : as recorded, backward : undo of it
+        void addNotes(const SeqDelta& d, bool forward){
+            if(d._ops.empty()) return;
+            _kinds |= NOTES;
+            for(size_t n = 0; n < d._ops.size(); ++n){
+                SeqDelta::Op op = d._ops[forward ? n : d._ops.size() - 1 - n];
+                if(!forward){
+                    if(op._type == SeqDelta::INSERTED) op._type = SeqDelta::ERASED;
+                    else if(op._type == SeqDelta::ERASED) op._type = SeqDelta::INSERTED;
+                    std::swap(op._before, op._after);
+                }
+                uint64 key = ((uint64)op._handle._index << 32) | op._handle._generation;
+                auto it = _index.find(key);
+                if(op._type == SeqDelta::UPDATED && it != _index.end() && _notes._ops[it->second]._type != SeqDelta::ERASED){
+                    _notes._ops[it->second]._after = op._after;
+                    continue;
+                }
+                _index[key] = _notes._ops.size();
+                _notes._ops.push_back(op);
+            }
+        }
+        void setLength(Duration oldLength, Duration newLength){
+            if(!has(LENGTH)) _oldLength = oldLength;
+            _newLength = newLength;
+            _kinds |= LENGTH;
         }
+        void clear(){
+            _kinds = 0;
+            _notes._ops.clear();
+            _index.clear();
+            _selected.clear();
+            _unselected.clear();
+        }
+    private:
+        std::unordered_map<uint64, size_t> _index; // Handle to op index in _notes
     };
     
-    typedef std::multimap<Duration, SequenceEntry> SeqStorage;
-    typedef std::multimap<Duration, SequenceEntry>::iterator SeqStorageItr;
-    typedef std::multimap<Duration, SequenceEntry>::const_iterator SeqStorageCItr;
-    typedef std::pair<Duration, SequenceEntry> SeqStoragePair;
-    
     struct Sequence : public Pattern{
     private:
         SeqStorage _seq;
         std::atomic<Duration> _length; // Now is lock - free
         std::shared_timed_mutex _seqmtx;
+        
+        // Undo / redo history. Each step is the delta recorded by the transaction(s), not a copy of the storage.
+        std::deque<SeqDelta> _undoStack;
+        std::deque<SeqDelta> _redoStack;
+        int _undoGroupDepth;
+        bool _undoGroupOpen; // Top of the undo stack is the step of the current group
+        std::unordered_map<uint64, size_t> _undoGroupIndex; // Handle to op index in the current group step, to merge the updates of the same note
+        
+        ChangeSet _changes; // Not notified yet. Main thread only.
+        uint32 _gridVersion = 0;
+        
+        void gridChanged(){
+            ++_gridVersion;
+            _changes._kinds |= ChangeSet::GRID;
+        }
+        
+        static uint64 HandleKey(NoteHandle h){ return ((uint64)h._index << 32) | h._generation; }
+        
+        // Slots retired by the discarded step can be reused. Erased notes are retired while the step is in the undo stack, and inserted notes while in the redo stack.
+        void releaseStep(const SeqDelta& d, SeqDelta::OpType retiredType){
+            std::vector<NoteHandle> handles;
+            for(const SeqDelta::Op& op : d._ops){
+                if(op._type == retiredType) handles.push_back(op._handle);
+            }
+            _seq.releaseRetired(handles);
+        }
+        
+        // Shall be called with write lock
+        void record(const SeqDelta& d){
+            if(d.empty()) return;
+            
+            for(const SeqDelta& r : _redoStack) releaseStep(r, SeqDelta::INSERTED);
+            _redoStack.clear();
+            
+            if(_undoGroupDepth > 0 && _undoGroupOpen){
+                SeqDelta& top = _undoStack.back();
+                if(d.hasLengthChange()){
+                    if(!top.hasLengthChange()) top._lengthBefore = d._lengthBefore; // Keep the first before
+                    top._lengthAfter = d._lengthAfter;
+                }
+                for(const SeqDelta::Op& op : d._ops){
+                    auto it = _undoGroupIndex.find(HandleKey(op._handle));
+                    if(op._type == SeqDelta::UPDATED && it != _undoGroupIndex.end()){
+                        top._ops[it->second]._after = op._after; // Keep the first _before
+                        continue;
+                    }
+                    _undoGroupIndex[HandleKey(op._handle)] = top._ops.size();
+                    top._ops.push_back(op);
+                }
+            }else{
+                _undoStack.push_back(d);
+                if(_undoGroupDepth > 0){
+                    _undoGroupOpen = true;
+                    _undoGroupIndex.clear();
+                    for(size_t i = 0; i < d._ops.size(); ++i) _undoGroupIndex[HandleKey(d._ops[i]._handle)] = i;
+                }
+                if(_undoStack.size() > (size_t)InternalParam::maxUndoSteps){
+                    releaseStep(_undoStack.front(), SeqDelta::ERASED);
+                    _undoStack.pop_front();
+                }
+            }
+        }
+        
+        // newLength : 0 to keep the current one.
+        std::vector<NoteHandle> commitBatch(const SeqStorage::Batch& b, Duration newLength){
+#if ENABLE_LOCK
+            std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
+#endif
+            SeqDelta d;
+            std::vector<NoteHandle> inserted = _seq.apply(b, &d);
+            if(newLength > 0 && newLength != getLength()){
+                d._lengthBefore = getLength();
+                d._lengthAfter = newLength;
+                setLength(newLength);
+            }
+            record(d);
+            _changes.addNotes(d, true);
+            return inserted;
+        }
+        
+        void closeUndoGroup(){
+            _undoGroupOpen = false;
+            _undoGroupIndex.clear();
+        }
     public:
         void readLock(){
 #if ENABLE_LOCK
@@ -112,50 +342,94 @@ public:
 #endif
         }
 
-        // Write operations which requires write lock(heavy)
-
-        SeqStorageItr insert(const SeqStoragePair& c){
-#if ENABLE_LOCK
-            std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
-#endif
-            return _seq.insert(c);
-        }
-        void erase(SeqStorageCItr cit){
-#if ENABLE_LOCK
-            std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
-#endif
-            _seq.erase(cit);
+        /**
+         * Batch edit.
+         * Changes are only collected until commit(), then applied under a single write lock with one sorted merge,
+         * so that the audio thread sees either none or all of them (never half of a drag).
+         * Changes are not visible through getStorage() before commit().
+         */
+        class Transaction{
+            Sequence& _owner;
+            SeqStorage::Batch _batch;
+            Duration _length;
+        public:
+            Transaction(Sequence& owner) : _owner(owner), _length(0) {}
+            ~Transaction(){ jassert(_batch.empty() && _length == 0); } // Forgot to commit?
+            
+            void insert(const SequenceEntry& c){ _batch._inserts.push_back(c); }
+            void erase(NoteHandle h){ _batch._erases.push_back(h); }
+            void update(NoteHandle h, const SequenceEntry& c){ _batch._ops.push_back({SeqStorage::Batch::OP_UPDATE, h, c}); }
+            void updateDuration(NoteHandle h, Duration d){ _batch._ops.push_back({SeqStorage::Batch::OP_DURATION, h, {0, 0, 0, d, 0}}); }
+            void updateVelocity(NoteHandle h, uint8 v){ _batch._ops.push_back({SeqStorage::Batch::OP_VELOCITY, h, {0, 0, 0, 0, v}}); }
+            // Loop length, changed together with the notes (i.e. in the same undo step).
+            void setLength(Duration l){ _length = l; }
+            
+            // Returns the handles of the inserted notes in the order of insert() call.
+            // The changes are recorded as one undo step (or merged into the current undo group).
+            std::vector<NoteHandle> commit(){
+                std::vector<NoteHandle> inserted;
+                if(_batch.empty() && _length == 0) return inserted;
+                inserted = _owner.commitBatch(_batch, _length);
+                _batch.clear();
+                _length = 0;
+                return inserted;
+            }
+        };
+        Transaction begin(){ return Transaction(*this); }
+        
+        /**
+         * All the transactions committed between beginUndoGroup() and endUndoGroup() are undone as a single step, e.g. a whole mouse drag.
+         * Can be nested.
+         */
+        void beginUndoGroup(){
+            ++_undoGroupDepth;
         }
-        void update(SeqStorageCItr cit, const SequenceEntry& c){
-#if ENABLE_LOCK
-            std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
-#endif
-            SeqStorageItr it = _seq.erase(cit, cit); // This is a trick !. Just convert const it -> normal it.
-            it->second = c;
+        void endUndoGroup(){
+            jassert(_undoGroupDepth > 0);
+            if(--_undoGroupDepth == 0) closeUndoGroup();
         }
-        void updateDuration(SeqStorageCItr cit, Duration d){
+        
+        bool canUndo() const { return _undoStack.size() > 0; }
+        bool canRedo() const { return _redoStack.size() > 0; }
+        
+        // Undo / redo is applied under a single write lock, same as commit of the transaction.
+        bool undo(){
 #if ENABLE_LOCK
             std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
 #endif
-            SeqStorageItr it = _seq.erase(cit, cit); // This is a trick !. Just convert const it -> normal it.
-            it->second._duration = d;
+            if(_undoStack.empty()) return false;
+            closeUndoGroup();
+            _seq.applyDelta(_undoStack.back(), false);
+            _changes.addNotes(_undoStack.back(), false);
+            if(_undoStack.back().hasLengthChange()) setLength(_undoStack.back()._lengthBefore);
+            _redoStack.push_back(std::move(_undoStack.back()));
+            _undoStack.pop_back();
+            return true;
         }
-        void updateVelocity(SeqStorageCItr cit, uint8 v){
+        bool redo(){
 #if ENABLE_LOCK
             std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
 #endif
-            SeqStorageItr it = _seq.erase(cit, cit); // This is a trick !. Just convert const it -> normal it.
-            it->second._vel = v;
+            if(_redoStack.empty()) return false;
+            closeUndoGroup();
+            _seq.applyDelta(_redoStack.back(), true);
+            _changes.addNotes(_redoStack.back(), true);
+            if(_redoStack.back().hasLengthChange()) setLength(_redoStack.back()._lengthAfter);
+            _undoStack.push_back(std::move(_redoStack.back()));
+            _redoStack.pop_back();
+            return true;
         }
-        void swapStorage(SeqStorage& other){
-#if ENABLE_LOCK
-            std::lock_guard<std::shared_timed_mutex> lg(_seqmtx);
-#endif
-            _seq.swap(other); // Iterators are remain valid with this.
+        
+        // Storage is replaced as a whole, e.g. on deserialize.
+        void clearHistory(){
+            _undoStack.clear();
+            _redoStack.clear();
+            closeUndoGroup();
         }
         
         // Lock free write operation
         void setLength(Duration l){
+            _changes.setLength(_length.load(), l);
             _length.store(l);
         }
         
@@ -165,36 +439,80 @@ public:
         // Lock-free read
         Duration getLength() const { return _length.load(); }
         
+        ChangeSet& pendingChanges(){ return _changes; }
+        
         // This is not a pure core data, but required for the GUI.
         Duration _gridIntervalDuration;
         
-        Sequence():_length(0), _gridIntervalDuration(Durations::BEAT8) {}
+        BeatGridMap _beatGrid; // Per beat division overriding _gridIntervalDuration
+        std::array<uint8, 128> _laneDivision; // Per pitch lane division overriding the others. 0 : not overridden.
+        
+        // Priority : lane > beat > global
+        int gridDivision() const { return GridTable::divisionOf(_gridIntervalDuration); } // Global one
+        int getLaneDivision(int note) const { return _laneDivision[note & 0x7f]; }
+        void setLaneDivision(int note, int div){
+            _laneDivision[note & 0x7f] = (uint8)(div == 0 ? 0 : jlimit(GridTable::minDivision, GridTable::maxDivision, div));
+            gridChanged();
+        }
+        void setGridInterval(Duration interval){
+            _gridIntervalDuration = interval;
+            gridChanged();
+        }
+        void setBeatDivision(int64 beat, int div){
+            _beatGrid.setBeatDivision(beat, div);
+            gridChanged();
+        }
+        // Incremented on any change of the grid, e.g. to validate the caches of the grid drawing.
+        uint32 gridVersion() const { return _gridVersion; }
+        int gridDivisionAt(Duration gridPos, int note) const {
+            int laneDiv = _laneDivision[note & 0x7f];
+            return laneDiv != 0 ? laneDiv : _beatGrid.effectiveDivision(gridPos, gridDivision());
+        }
+        Duration snapToGrid(Duration gridPos, int note) const { return GridTable::snap(gridPos, gridDivisionAt(gridPos, note)); }
+        // Bit test of the cached grid membership of the note. No division per note.
+        bool isOnGrid(const SequenceEntry& e, GridTable::Mask gridMask) const { return GridTable::isOnGrid(gridMask, gridDivisionAt(e._pos - e._nudge, e._note)); }
+        // Slots of the notes matched with the query, with the effective grid division for the grid condition.
+        void select(const NoteQuery& q, SeqStorage::Bitmap& out) const {
+            _seq.select(q, [this](Duration gridPos, int note){ return gridDivisionAt(gridPos, note); }, out);
+        }
+        const std::vector<Duration>& getGridLines(){ return _beatGrid.getLines(getLength(), gridDivision()); }
+        
+        Sequence():_length(0), _undoGroupDepth(0), _undoGroupOpen(false), _gridIntervalDuration(Durations::BEAT8) { _laneDivision.fill(0); }
         virtual void serialize(MemoryOutputStream& outputStream) override {
             outputStream.writeInt64(_length);
             outputStream.writeInt((int)_seq.size());
-            for(auto it = _seq.begin(); it != _seq.end(); ++it){
-                outputStream.writeInt(it->second._note);
-                outputStream.writeInt64(it->second._pos);
-                outputStream.writeInt64(it->second._nudge);
-                outputStream.writeInt64(it->second._duration);
-                outputStream.writeByte(it->second._vel);
+            for(size_t i = 0; i < _seq.size(); ++i){
+                SequenceEntry e = _seq.entryAt(i);
+                outputStream.writeInt(e._note);
+                outputStream.writeInt64(e._pos);
+                outputStream.writeInt64(e._nudge);
+                outputStream.writeInt64(e._duration);
+                outputStream.writeByte(e._vel);
             }
             
             outputStream.writeInt64(_gridIntervalDuration);
+            _beatGrid.serialize(outputStream);
+            for(uint8 d : _laneDivision) outputStream.writeByte((char)d);
         }
         virtual void deserialize(MemoryInputStream& inputStream) override {
             _length = inputStream.readInt64();
             int nSeqEntry = inputStream.readInt();
             _seq.clear();
+            clearHistory();
             for(int i = 0; i < nSeqEntry; ++i){
                 int note = inputStream.readInt();
                 Duration pos = inputStream.readInt64();
                 Duration nudge = inputStream.readInt64();
                 Duration duration = inputStream.readInt64();
                 uint8 vel = (uint8)inputStream.readByte();
-                _seq.insert(SeqStoragePair(pos, {note, pos, nudge, duration, vel}));
+                _seq.insert({note, pos, nudge, duration, vel});
             }
             _gridIntervalDuration = inputStream.readInt64();
+            _beatGrid.deserialize(inputStream);
+            for(uint8& d : _laneDivision) d = (uint8)inputStream.readByte();
+            ++_gridVersion;
+            _changes.clear();
+            _changes._kinds = ChangeSet::RESET;
         }
     };
     
@@ -226,6 +544,42 @@ protected:
     };
     ScheduleTime _noteOnsForRec[128];
     
+    // Notes recorded by the audio thread, handed to the message thread without lock.
+    // Committed there as a transaction, i.e. undoable and notified as a change set like any other edit.
+    static const int recFifoSize = 256;
+    AbstractFifo _recFifo{recFifoSize};
+    SequenceEntry _recBuffer[recFifoSize];
+    
+    // Host time at the end of the last block, and the musical time scheduled up to then. Audio thread only.
+    // While the host plays continuously, the next block starts scheduling where the last one ended, even if the lookahead has been changed in between.
+    int64 _lastBlockEnd = std::numeric_limits<int64>::min();
+    int64 _lastWindowEnd = 0;
+    
+    // Per pitch lane (i.e. per DrumMap entry) mute / solo state.
+    // 128 bits, one per note number, held in 2 atomic words so that the audio thread can read it without lock.
+    // Toggling a lane only flips a bit. Neither the sequence nor any scheduling data needs to be rebuilt.
+    struct LaneMask{
+        std::atomic<uint64> _bits[2];
+        
+        LaneMask(){ clear(); }
+        void clear(){
+            _bits[0].store(0);
+            _bits[1].store(0);
+        }
+        void set(int note, bool v){
+            uint64 bit = uint64(1) << (note & 63);
+            if(v) _bits[note >> 6].fetch_or(bit);
+            else  _bits[note >> 6].fetch_and(~bit);
+        }
+        bool test(int note) const {
+            return (_bits[note >> 6].load() >> (note & 63)) & 1;
+        }
+        bool any() const {
+            return (_bits[0].load() | _bits[1].load()) != 0;
+        }
+    };
+    LaneMask _laneMute;
+    LaneMask _laneSolo;
     
     // Serialize target GUI data
     bool _lockOffGrid = true;
@@ -237,12 +591,29 @@ public:
     const bool getLockOffGrid(){ return _lockOffGrid; }
     void setLockOffGrid(bool v){ _lockOffGrid = v; }
     
-    SequenceDrummer(DrunkerProcessor& dp, ParameterManager& pm) : _bpm(0.0), _dp(dp), _pm(pm) {
+    // Lock free. Can be called from any thread, and takes effect from the next processBlock.
+    void setLaneMute(int note, bool v){ _laneMute.set(note, v); }
+    void setLaneSolo(int note, bool v){ _laneSolo.set(note, v); }
+    bool isLaneMuted(int note) const { return _laneMute.test(note); }
+    bool isLaneSoloed(int note) const { return _laneSolo.test(note); }
+    bool isAnyLaneSoloed() const { return _laneSolo.any(); }
+    
+    // Audible if not muted, and soloed when any of the lanes is soloed.
+    bool isLaneAudible(int note) const {
+        return !isLaneMuted(note) && (!isAnyLaneSoloed() || isLaneSoloed(note));
+    }
+    
+    SequenceDrummer(DrunkerProcessor& dp, ParameterManager& pm) : _bpm(0.0), _dp(dp), _pm(pm), _onFront(true) {
         // https://hirasho.github.io/page/sound/gm-drums.html
         _map = {36, 40, 42, 46, 49, 51, 53}; // Seems YAMAHA style number is used ?
         
         _seq.setLength(Durations::BEAT1*2);
-        _seq.insert(SeqStoragePair(Durations::BEAT4*0, {_map.bs, Durations::BEAT4*0, 0, Durations::BEAT16, 127}));
+        {
+            Sequence::Transaction tr = _seq.begin();
+            tr.insert({_map.bs, Durations::BEAT4*0, 0, Durations::BEAT16, 127});
+            tr.commit();
+            _seq.clearHistory(); // Initial content is not an edit
+        }
         /*
         _seq._seq.insert({_map.bs, Durations::BEAT4*1, 0, Durations::BEAT16, 127});
         _seq._seq.insert({_map.snare, Durations::BEAT4*1, 0, Durations::BEAT16, 127});
@@ -264,6 +635,17 @@ public:
         return commonLocalTimeSamples;
     }
     
+    // Extrapolation is limited to 100ms, so that the playhead stops rather than runs away when the audio thread stalls.
+    virtual Duration getPlayheadInDuration(double nowMs) const override {
+        PlayheadSnapshot ps = getPlayhead();
+        int64 samples = ps._timeInSamples;
+        if(ps._running && _fs > 0){
+            double elapsedMs = jlimit(0.0, 100.0, nowMs - ps._stampMs);
+            samples += (int64)(elapsedMs * 0.001 * _fs);
+        }
+        return mod(asDuration(samples, ps._bpm), _seq.getLength());
+    }
+    
     virtual void processBlock(int blockSize, const AudioPlayHead::CurrentPositionInfo& cp,
                       MidiBuffer& midi, bool& updateUI) override
     {
@@ -281,8 +663,11 @@ public:
         
         if(!_pm.getBool(ParameterManager::PLAYSTOP_PARAM)){
             _time = 0;
+            _lastBlockEnd = std::numeric_limits<int64>::min();
+            publishPlayhead(0, _bpm, false);
             return;
         }
+        publishPlayhead(_time - _lookaheadSamples.load(), _bpm, true); // Audible position, i.e. behind the scheduling by the lookahead.
         
         // Use the copied value
         int64 time_now = _time;
@@ -310,7 +695,10 @@ public:
                             newEntry._nudge = 0;
                             newEntry._vel = _noteOnsForRec[note]._onVel;
                             newEntry._duration = asDuration(durationSamples, bpm_now);
-                            seq->insert(SequenceDrummer::SeqStoragePair(newEntry._pos,newEntry));
+                            int start1, size1, start2, size2;
+                            _recFifo.prepareToWrite(1, start1, size1, start2, size2);
+                            if(size1 > 0) _recBuffer[start1] = newEntry; // Dropped if the message thread is too far behind
+                            _recFifo.finishedWrite(size1);
                             _noteOnsForRec[note]._valid = false;
                             updateUI = true;
                         }else{
@@ -325,14 +713,19 @@ public:
             
             int64 seqLengthSamples = asSamples(seq->getLength(), bpm_now);
             
-            // If start time is within this block, then schedule
-            //int64 time = time_now; // can be nagative !
-            int localTimeSamples = static_cast<int>(mod(time_now, seqLengthSamples)); // assume int64 is no longer needed. pattern local time.
+            // In lookahead mode, the host delays our output by the reported latency.
+            // Hence the output at time_now is for the musical time (time_now - lookahead), and a note nudged before the grid(even before 0) can be sent earlier than the host's playhead.
+            int lookahead = _pm.getBool(ParameterManager::LOOKAHEAD_PARAM) ? lookaheadSamplesFor(bpm_now) : 0;
+            _requiredLookaheadSamples.store(lookahead);
+            int64 blockBase = time_now - _lookaheadSamples.load(); // Musical time of the first sample of this block. Can be negative.
             
-            Duration timeDuration = asDuration(time_now, bpm_now);
-            Duration localStartTimeDurations = mod(timeDuration, seq->getLength());
-            Duration blockSizeDurations = asDuration(blockSize, bpm_now);
-            Duration localEndTimeDurations = mod(localStartTimeDurations + blockSizeDurations, seq->getLength()); // can be in the head of next loop
+            // Musical time window scheduled in this block. Normally [blockBase, blockBase + blockSize).
+            // Right after a lookahead change, it starts at the end of the last window instead, so that no note is played twice or skipped.
+            // The window is then longer (lookahead shrunk, the extra notes are squeezed into this block) or shorter, even empty until the time catches up (lookahead grown).
+            int64 windowStart = (time_now == _lastBlockEnd) ? _lastWindowEnd : blockBase;
+            int64 windowEnd = jmax(windowStart, blockBase + blockSize);
+            _lastBlockEnd = time_now + blockSize;
+            _lastWindowEnd = windowEnd;
             
             // Firstly, sendNote Off
             
@@ -347,26 +740,37 @@ public:
                 }
             }
             
-            SeqStorageCItr its[2][2];
-            its[0][0] = seq->getStorage().lower_bound(localStartTimeDurations);
-            its[0][1] = localEndTimeDurations > localStartTimeDurations ?
-                seq->getStorage().upper_bound(localEndTimeDurations) :
-                seq->getStorage().lower_bound(seq->getLength()); // As we should not use the note with pos = seq->_length, use lower limit on purpose.
-            if(localEndTimeDurations > localStartTimeDurations){
-                its[1][0] = its[1][1] = seq->getStorage().end(); // No need to consider
-            }else{
-                its[1][0] = seq->getStorage().begin();
-                its[1][1] = seq->getStorage().upper_bound(localEndTimeDurations);
+            // Snapshot the lane masks once per block, and make the audible mask. Each event only needs a bit test then.
+            uint64 audible[2];
+            {
+                uint64 mute[2] = { _laneMute._bits[0].load(), _laneMute._bits[1].load() };
+                uint64 solo[2] = { _laneSolo._bits[0].load(), _laneSolo._bits[1].load() };
+                bool anySolo = (solo[0] | solo[1]) != 0;
+                for(int w = 0; w < 2; ++w)
+                    audible[w] = ~mute[w] & (anySolo ? solo[w] : ~uint64(0));
             }
             
-            for(int s = 0; s < 2; ++s){
-                auto it = its[s][0];
-                while(it != its[s][1]){
-                    const SequenceEntry& e = it->second;
-                    Duration d = e._pos;
-                    int64 offset = (asSamples(d, bpm_now) - localTimeSamples + seqLengthSamples) % seqLengthSamples;
-                    if(offset < blockSize){
+            // A note at pos is played at asSamples(pos) + k * seqLengthSamples (k >= 0) in musical time.
+            // As -length <= pos < length, only a few k can hit this block.
+            // Storage is searched by Duration with 1 sample margin, and then the exact judge is done in samples so that no note is played twice over the blocks.
+            // The search is within the bar bucket of the window edge, hence the cost does not depend on the length of the sequence.
+            Duration margin = asDuration(1, bpm_now) + 1;
+            int64 kFirst = jmax(int64(0), (windowStart - mod(windowStart, seqLengthSamples)) / seqLengthSamples - 1);
+            int64 kLast  = (windowEnd - mod(windowEnd, seqLengthSamples)) / seqLengthSamples + 1;
+            
+            for(int64 k = kFirst; k <= kLast; ++k){
+                int64 localStart = windowStart - k * seqLengthSamples;
+                const SeqStorage& storage = seq->getStorage();
+                size_t end = storage.upperBound(jmin(asDuration(localStart + (windowEnd - windowStart), bpm_now) + margin, seq->getLength()));
+                for(size_t i = storage.lowerBound(asDuration(localStart, bpm_now) - margin); i < end; ++i){
+                    SequenceEntry e = storage.entryAt(i);
+                    if(e._pos >= seq->getLength()) break; // As we should not use the note with pos = seq->_length.
+                    if( !((audible[e._note >> 6] >> (e._note & 63)) & 1) ) continue;
+                    
+                    int64 inWindow = asSamples(e._pos, bpm_now) - localStart;
+                    if(0 <= inWindow && inWindow < windowEnd - windowStart){
                         // In this block !
+                        int64 offset = jmax(int64(0), jmin(int64(blockSize - 1), inWindow + windowStart - blockBase));
                         midi.addEvent (MidiMessage::noteOn   (1, e._note, e._vel), static_cast<int>(offset));
                         
                         int64 noteDurationSamples = asSamples(e._duration, bpm_now);
@@ -378,7 +782,6 @@ public:
                             _noteOffs.insert({time_now + offset + noteDurationSamples, e._note});
                         }
                     }
-                    ++it;
                 }
             }
             
@@ -409,20 +812,15 @@ public:
             
             // Pre search the minimum position. If minimum position is negative, then shift all the notes so that they becomes positive time
             Duration minPos = std::numeric_limits<Duration>::max();
-            for(auto it = seq->getStorage().begin(); it != seq->getStorage().end(); ++it){
-                const SequenceEntry& e = it->second;
-                minPos = jmin(e._pos, minPos);
-                if(e._pos > seq->getLength()) break;
-            }
+            if(!seq->getStorage().empty()) minPos = seq->getStorage().posAt(0); // Sorted by _pos
             
             Duration exportShift = 0;
             if(minPos < 0){
                 exportShift = int(std::ceil(-minPos/(double)Durations::BEAT4)) * Durations::BEAT4;
             }
             
-            for(auto it = seq->getStorage().begin(); it != seq->getStorage().end(); ++it){
-                const SequenceEntry& e = it->second;
-                if(e._pos > seq->getLength()) break;
+            for(size_t i = 0, end = seq->getStorage().upperBound(seq->getLength()); i < end; ++i){
+                SequenceEntry e = seq->getStorage().entryAt(i);
                 ms.addEvent( MidiMessage::noteOn(1, e._note, e._vel).withTimeStamp(asTicks(e._pos + exportShift, 960)));
                 ms.addEvent( MidiMessage::noteOff(1, e._note).withTimeStamp(asTicks(e._pos + e._duration + exportShift, 960)));
             }
@@ -448,59 +846,241 @@ public:
     virtual void serialize(MemoryOutputStream& outputStream) override {
         _seq.serialize(outputStream);
         outputStream.writeBool(_lockOffGrid);
+        for(int w = 0; w < 2; ++w){
+            outputStream.writeInt64((int64)_laneMute._bits[w].load());
+            outputStream.writeInt64((int64)_laneSolo._bits[w].load());
+        }
     }
     
     virtual void deserialize(MemoryInputStream& inputStream) override {
         _seq.deserialize(inputStream);
         _lockOffGrid = inputStream.readBool();
+        for(int w = 0; w < 2; ++w){
+            _laneMute._bits[w].store((uint64)inputStream.readInt64());
+            _laneSolo._bits[w].store((uint64)inputStream.readInt64());
+        }
     }
     
 public:
     /* --------------------------------- */
     // Utility functions for selections. Not a scope for serialization.
     // Will be reset when GUI is re-constructed
-    // TODO : More appropirate data structure design ?
     
     struct Selection{
-        //SequenceDrummer::SequenceEntry* _selSeq;
-        SeqStorageCItr _selSeqItr; // This is valid only when
+        NoteHandle _handle; // Stable until the note is erased. Not affected by any re-ordering of the storage.
         SequenceDrummer::SequenceEntry _mouseDownSnapShot; // snap shot when mouse is down.
+    };
+    
+    /**
+     * Set of selections keyed by the note handle.
+     * Membership test, insert and remove are O(1) : the slot index of the handle maps to the position in the dense item array.
+     * Order of the items is not kept on remove.
+     * Aggregates of the snap shots (velocity min / max, nudge sum) are maintained incrementally, hence snap shots are only modified through updateSnapShot().
+     */
+    class Selections{
+        static const uint32 NONE = 0xffffffff;
+        std::vector<Selection> _items;
+        std::vector<uint32> _where; // Indexed by NoteHandle::_index. Position in _items, or NONE.
+        
+        std::array<uint32, 128> _velCount; // Histogram of snap shot velocity, min / max is found by (constant) 128 bins scan.
+        int64 _nudgeSum;
+        
+        void addAggregate(const SequenceEntry& e){
+            ++_velCount[e._vel & 0x7f];
+            _nudgeSum += e._nudge;
+        }
+        void removeAggregate(const SequenceEntry& e){
+            --_velCount[e._vel & 0x7f];
+            _nudgeSum -= e._nudge;
+        }
+    public:
+        Selections() : _nudgeSum(0) { _velCount.fill(0); }
+        
+        typedef std::vector<Selection>::const_iterator iterator;
+        typedef std::vector<Selection>::const_iterator const_iterator;
+        const_iterator begin() const { return _items.begin(); }
+        const_iterator end() const { return _items.end(); }
+        size_t size() const { return _items.size(); }
+        bool empty() const { return _items.empty(); }
         
-        bool operator<(const Selection& rh) const{
-            return (*_selSeqItr) < (*rh._selSeqItr);
+        bool contains(NoteHandle h) const {
+            return h._index < _where.size() && _where[h._index] != NONE && _items[_where[h._index]]._handle == h;
+        }
+        
+        // Returns false if already selected
+        bool insert(const Selection& s){
+            if(contains(s._handle)) return false;
+            if(s._handle._index >= _where.size()) _where.resize(s._handle._index + 1, NONE);
+            _where[s._handle._index] = (uint32)_items.size();
+            _items.push_back(s);
+            addAggregate(s._mouseDownSnapShot);
+            return true;
+        }
+        
+        // Returns false if not selected
+        bool erase(NoteHandle h){
+            if(!contains(h)) return false;
+            uint32 pos = _where[h._index];
+            removeAggregate(_items[pos]._mouseDownSnapShot);
+            _where[h._index] = NONE;
+            if(pos + 1 != _items.size()){
+                _items[pos] = _items.back();
+                _where[_items[pos]._handle._index] = pos;
+            }
+            _items.pop_back();
+            return true;
+        }
+        
+        template<class Pred>
+        void remove_if(Pred pred){
+            size_t w = 0;
+            for(size_t r = 0; r < _items.size(); ++r){
+                if(pred(_items[r])){
+                    removeAggregate(_items[r]._mouseDownSnapShot);
+                    _where[_items[r]._handle._index] = NONE;
+                }else{
+                    if(w != r) _items[w] = _items[r];
+                    _where[_items[w]._handle._index] = (uint32)w;
+                    ++w;
+                }
+            }
+            _items.resize(w);
+        }
+        
+        void clear(){
+            for(const Selection& s : _items) _where[s._handle._index] = NONE;
+            _items.clear();
+            _velCount.fill(0);
+            _nudgeSum = 0;
+        }
+        
+        void swap(Selections& other){
+            _items.swap(other._items);
+            _where.swap(other._where);
+            _velCount.swap(other._velCount);
+            std::swap(_nudgeSum, other._nudgeSum);
+        }
+        
+        void updateSnapShot(const_iterator it, const SequenceEntry& e){
+            Selection& s = _items[it - _items.begin()];
+            removeAggregate(s._mouseDownSnapShot);
+            s._mouseDownSnapShot = e;
+            addAggregate(e);
+        }
+        
+        // Aggregates of the snap shots. O(1).
+        // Returns 128 / -1 for the empty selection.
+        int minVelocity() const {
+            for(int v = 0; v < 128; ++v) if(_velCount[v] > 0) return v;
+            return 128;
+        }
+        int maxVelocity() const {
+            for(int v = 127; v >= 0; --v) if(_velCount[v] > 0) return v;
+            return -1;
         }
+        int64 sumNudge() const { return _nudgeSum; }
+        double averageNudge() const { return _items.size() > 0 ? (double)_nudgeSum / _items.size() : 0.0; }
     };
+    typedef Selections::iterator SelectionItr;
     
-    typedef std::list<Selection> Selections;
-    typedef std::list<Selection>::iterator SelectionItr;
-    
-    
-    // Utility function for manupirating multiset
-    static size_t EraseSelection(Selections& sels, SeqStorageCItr seqItr){
-        sels.remove_if([seqItr](const Selection& s){ return s._selSeqItr == seqItr; });
-        return 1;
-    }
-    
-    // Utility function for manupirating multiset
-    static bool FindSelection(const Selections& sels, SeqStorageCItr seqItr){
-        for(const Selection& s : sels){
-            if(s._selSeqItr == seqItr) return true;
-        }
-        return false;
-    }
 private:
     Selections _sellist;
-    std::list< std::function<void(void)> > _cbs;
+    SeqStorage::Bitmap _matched; // Work area of selectMatching / unSelectMatching
+    std::list< std::function<void(const ChangeSet&)> > _cbs;
     
     // This is used for the tempral object while use gesture for e.g. Alt + mouse move.
-    SeqStorage _stashedStorage;
-    Selections _stashedSellist;
+    // Only the delta against the front (move) state is kept : the selected notes at stash() and their duplicates while on the back (copy) state.
+    struct StashEntry{
+        NoteHandle _orgHandle;
+        SequenceEntry _orgEntry; // Entry at stash()
+        NoteHandle _dupHandle; // Valid only while on the back
+    };
+    std::vector<StashEntry> _stashed;
     bool _onFront;
     
+    // moved : position of the note on the side switched to, from the current entry on the side switched from.
+    void switchFrontBack(bool selectFront, std::function<SequenceEntry(const SequenceEntry& current, const StashEntry& se)> moved){
+        if(selectFront == _onFront) return;
+        
+        Sequence::Transaction tr = _seq.begin();
+        selClear();
+        if(selectFront){
+            // Originals take over the duplicates' position, then the duplicates are removed.
+            for(StashEntry& se : _stashed){
+                tr.update(se._orgHandle, moved(_seq.getStorage().get(se._dupHandle), se));
+                tr.erase(se._dupHandle);
+                se._dupHandle = NoteHandle();
+            }
+            tr.commit();
+            for(const StashEntry& se : _stashed) selInsert({se._orgHandle, se._orgEntry});
+        }else{
+            // Duplicates are made at the current position, and the originals go back to where they were.
+            for(const StashEntry& se : _stashed){
+                tr.insert(moved(_seq.getStorage().get(se._orgHandle), se));
+                tr.update(se._orgHandle, se._orgEntry);
+            }
+            std::vector<NoteHandle> dupHandles = tr.commit();
+            for(size_t i = 0; i < _stashed.size(); ++i){
+                _stashed[i]._dupHandle = dupHandles[i];
+                selInsert({dupHandles[i], _stashed[i]._orgEntry});
+            }
+        }
+        _onFront = selectFront;
+    }
+    
+    // Current entry moved by the delta from the snap shot. Snapped to the grid, and the nudge is kept.
+    SequenceEntry draggedEntry(const SequenceEntry& snapShot, const SequenceEntry& current, float deltaX, int deltaNote) const {
+        Duration x = snapShot._pos - snapShot._nudge + (Duration)deltaX;
+        int note = snapShot._note + deltaNote;
+        
+        SequenceEntry newEntry = current;
+        newEntry._pos = _seq.snapToGrid(x, note) + snapShot._nudge;
+        newEntry._nudge = snapShot._nudge; // same nudge value
+        newEntry._note = note;
+        return newEntry;
+    }
+    
+    // Changes (incl. the ones not notified with NoNotification) are delivered at once, then cleared.
     void doCallback(){
+        ChangeSet& changes = _seq.pendingChanges();
         for(auto cb : _cbs){
-            cb();
+            cb(changes);
         }
+        changes.clear();
+    }
+    
+    // All the changes of the selection membership go through these, so that the selection delta is recorded.
+    bool selInsert(const Selection& s){
+        if(!_sellist.insert(s)) return false;
+        _seq.pendingChanges()._kinds |= ChangeSet::SELECTION;
+        _seq.pendingChanges()._selected.push_back(s._handle);
+        return true;
+    }
+    bool selErase(NoteHandle h){
+        if(!_sellist.erase(h)) return false;
+        _seq.pendingChanges()._kinds |= ChangeSet::SELECTION;
+        _seq.pendingChanges()._unselected.push_back(h);
+        return true;
+    }
+    template<class Pred>
+    void selRemoveIf(Pred pred){
+        ChangeSet& changes = _seq.pendingChanges();
+        _sellist.remove_if([&pred, &changes](const Selection& s){
+            if(!pred(s)) return false;
+            changes._kinds |= ChangeSet::SELECTION;
+            changes._unselected.push_back(s._handle);
+            return true;
+        });
+    }
+    void selClear(){
+        selRemoveIf([](const Selection&){ return true; });
+    }
+    void selAssign(const Selections& other){
+        selRemoveIf([&other](const Selection& s){ return !other.contains(s._handle); });
+        for(const Selection& s : other){
+            if(!_sellist.contains(s._handle)) selInsert(s);
+        }
+        _sellist = other; // Snap shots and the order are taken from other
     }
     
     enum NotificationType {
@@ -513,9 +1093,23 @@ public:
     /*
      * Clear callbacks and selections
      */
+    virtual void commitRecorded() override {
+        int start1, size1, start2, size2;
+        _recFifo.prepareToRead(_recFifo.getNumReady(), start1, size1, start2, size2);
+        if(size1 + size2 == 0) return;
+        
+        Sequence::Transaction tr = _seq.begin();
+        for(int i = 0; i < size1; ++i) tr.insert(_recBuffer[start1 + i]);
+        for(int i = 0; i < size2; ++i) tr.insert(_recBuffer[start2 + i]);
+        _recFifo.finishedRead(size1 + size2);
+        tr.commit();
+        doCallback();
+    }
+    
     virtual void clearContextInfo() override {
         _sellist.clear();
         _cbs.clear();
+        _playheadCbs.clear();
     }
     
     const Selections& getSelection() const {
@@ -529,126 +1123,194 @@ public:
     
     void setSelection(const Selections& other, NotificationType notify = NotifySync)
     {
-        _sellist = other;
+        selAssign(other);
         if(notify == NotifySync) doCallback();
     }
     
-    void addCallback(std::function<void(void)> cb)
+    void addCallback(std::function<void(const ChangeSet&)> cb)
     {
         _cbs.push_back(cb);
     }
     
     void removeSelected(NotificationType notify = NotifySync){
+        Sequence::Transaction tr = _seq.begin();
         for(SelectionItr sit = _sellist.begin(); sit != _sellist.end(); ++sit )
         {
-            _seq.erase(sit->_selSeqItr);
+            tr.erase(sit->_handle);
         }
-        _sellist.clear();
+        tr.commit();
+        selClear();
         if(notify == NotifySync) doCallback();
     }
     
     void clearSelection(NotificationType notify = NotifySync){
-        _sellist.clear();
+        selClear();
         if(notify == NotifySync) doCallback();
     }
     
-    void deleteSelection(SeqStorageCItr it, NotificationType notify = NotifySync){
-        //_sellist.erase({it}); // This is not a valid way. If the same _pos notes are inserted, all of them will be removed as they are equivalent in terms of _pos.
-        EraseSelection(_sellist, it);
+    void deleteSelection(NoteHandle h, NotificationType notify = NotifySync){
+        selErase(h);
         if(notify == NotifySync) doCallback();
     }
     
-    void addSelection(SeqStorageCItr it, NotificationType notify = NotifySync){
-        _sellist.push_back({it, it->second});
+    void addSelection(NoteHandle h, NotificationType notify = NotifySync){
+        selInsert({h, _seq.getStorage().get(h)});
         if(notify == NotifySync) doCallback();
     }
     
-    void moveSelectedNote(SelectionItr sit, const SequenceEntry& newEntry, bool keepStash = false, NotificationType notify = NotifySync){
-        _seq.erase(sit->_selSeqItr);
-        SeqStorageItr newIt = _seq.insert(SeqStoragePair(newEntry._pos, newEntry));
-        
-        sit->_selSeqItr = newIt;
-        if(!keepStash) sit->_mouseDownSnapShot = newIt->second;
+    // Select (true) / unselect (false) each of the notes, then notify once.
+    void setSelected(const std::vector<std::pair<NoteHandle, bool>>& states, NotificationType notify = NotifySync){
+        for(const std::pair<NoteHandle, bool>& st : states){
+            if(st.second) selInsert({st.first, _seq.getStorage().get(st.first)});
+            else selErase(st.first);
+        }
+        if(notify == NotifySync) doCallback();
+    }
+    
+    // Change is applied when the transaction is committed. Handle is kept.
+    void moveSelectedNote(Sequence::Transaction& tr, SelectionItr sit, const SequenceEntry& newEntry, bool keepStash = false){
+        tr.update(sit->_handle, newEntry);
+        if(!keepStash) _sellist.updateSnapShot(sit, newEntry);
     }
     
     void notifySelectionUpdate(NotificationType notify = NotifySync){
         if(notify == NotifySync) doCallback();
     }
     
-    bool isSelected(SeqStorageCItr it){
-        return FindSelection(_sellist, it);
+    // Deliver the pending changes, e.g. after the length or the grid is changed directly through the sequence.
+    void notifyChanges(){
+        doCallback();
+    }
+    
+    /**
+     * Undo / redo the last edit step of the sequence.
+     * Selections to the notes which no longer exist are dropped, and the rest are re-fixed to the restored values.
+     */
+    bool undo(NotificationType notify = NotifySync){
+        if(!_seq.undo()) return false;
+        onHistoryApplied(notify);
+        return true;
+    }
+    bool redo(NotificationType notify = NotifySync){
+        if(!_seq.redo()) return false;
+        onHistoryApplied(notify);
+        return true;
+    }
+    void onHistoryApplied(NotificationType notify){
+        const SeqStorage& storage = _seq.getStorage();
+        selRemoveIf([&storage](const Selection& s){ return !storage.isValid(s._handle); });
+        fixSelection();
+        if(notify == NotifySync) doCallback();
+    }
+    
+    bool isSelected(NoteHandle h) const {
+        return _sellist.contains(h);
+    }
+    
+    // Current value of the selected note
+    SequenceEntry getEntry(const Selection& s) const {
+        return _seq.getStorage().get(s._handle);
     }
     
     /**
      * This can be time consumeing if the number of notes is huge. Normally, no worries for that, though.
      * NOTE : Should not be called outside main-thread as we do not read lock the sequence data here.
      */
-    void selectIf(std::function<bool(const SequenceEntry& e)> pred, NotificationType notify = NotifySync){
-
-        for(SeqStorageCItr it = _seq.getStorage().begin(); it != _seq.getStorage().end(); ++it)
+    // gridMask is the cached grid membership of the note. See GridTable.
+    void selectIf(std::function<bool(const SequenceEntry& e, GridTable::Mask gridMask)> pred, NotificationType notify = NotifySync){
+        const SeqStorage& storage = _seq.getStorage();
+        for(size_t i = 0; i < storage.size(); ++i)
         {
-            if(pred(it->second)){
-                addSelection(it, NoNotification);
+            SequenceEntry e = storage.entryAt(i);
+            if(pred(e, storage.gridMaskAt(i))){
+                selInsert({storage.handleAt(i), e});
             }
         }
 
         if(notify == NotifySync) doCallback();
     }
     
-    void unSelectIf(std::function<bool(const SequenceEntry& e)> pred, NotificationType notify = NotifySync){
-        _sellist.remove_if([pred](const Selection& s){ return pred(s._selSeqItr->second); });
+    void unSelectIf(std::function<bool(const SequenceEntry& e, GridTable::Mask gridMask)> pred, NotificationType notify = NotifySync){
+        const SeqStorage& storage = _seq.getStorage();
+        selRemoveIf([pred, &storage](const Selection& s){ return pred(storage.get(s._handle), storage.gridMask(s._handle)); });
+        if(notify == NotifySync) doCallback();
+    }
+    
+    /**
+     * Add / remove the notes matched with the query to / from the selection.
+     * Single column scan into the bitmap, cheap enough to re-run on every key stroke of a filter.
+     * NOTE : Should not be called outside main-thread as we do not read lock the sequence data here.
+     */
+    void selectMatching(const NoteQuery& q, NotificationType notify = NotifySync){
+        const SeqStorage& storage = _seq.getStorage();
+        _seq.select(q, _matched);
+        _matched.forEach([this, &storage](uint32 slot){
+            NoteHandle h = storage.handleOfSlot(slot);
+            selInsert({h, storage.get(h)});
+        });
+        if(notify == NotifySync) doCallback();
+    }
+    void unSelectMatching(const NoteQuery& q, NotificationType notify = NotifySync){
+        _seq.select(q, _matched);
+        selRemoveIf([this](const Selection& s){ return _matched.test(s._handle._index); });
         if(notify == NotifySync) doCallback();
     }
     
     // Kind of provide parallel 2 verions of sequence and selection data, used for e.g. copy-dragging gesture etc.
+    // Front : selected notes are moved. Back : selected notes stay at the original position, and their duplicates are moved.
     
     /**
-     * Make another set (back buffer) of sequence and selection
+     * Start the front / back state from the current selection as the front. O(selection).
      * NOTE : Should not be called outside main-thread as we do not read lock the sequence data here.
      */
     void stash(){
-        _onFront = true; // Once stash is called current active data is treated as front data. 
-        
-        _stashedStorage.clear();
-        _stashedSellist.clear();
-        
-        for(SeqStorageCItr it = _seq.getStorage().begin(); it != _seq.getStorage().end(); ++it){
-            SequenceDrummer::SequenceEntry dupEntry = it->second;
-            SeqStorageItr dupIt = _stashedStorage.insert(SeqStoragePair(dupEntry._pos, dupEntry));
-            if( FindSelection(_sellist, it) ){
-                _stashedSellist.push_back({dupIt, dupIt->second});
-            }
+        _onFront = true;
+        _stashed.clear();
+        _stashed.reserve(_sellist.size());
+        for(const Selection& s : _sellist){
+            _stashed.push_back({s._handle, getEntry(s), NoteHandle()});
         }
     }
     
-    void labelCurrentAs(bool front){
-        _onFront = front;
+    /**
+     * Switch between the front and the back by applying the delta, in a single transaction. O(selection).
+     * The current (dragged) position is carried over to the other side.
+     * Selection snap shots are the entries at stash(), so that the drag continues from the same origin.
+     */
+    void selectFrontBack(bool selectFront){
+        switchFrontBack(selectFront, [](const SequenceEntry& current, const StashEntry&){ return current; });
     }
     
     /**
-     * Swap the back buffer and front buffer
+     * dragSelected() with the switch of front / back, in a single transaction,
+     * so that the audio thread never plays the duplicates stacked on the originals in between.
      */
-    void selectFrontBack(bool selectFront){
-        if(selectFront == _onFront){
-            // true,true || false,false
-        }else{
-            _seq.swapStorage(_stashedStorage);
-            _sellist.swap(_stashedSellist);
-            _onFront = !_onFront;
-        }
+    bool dragFrontBack(bool selectFront, float deltaX, int deltaNote){
+        if(selectFront == _onFront) return dragSelected(deltaX, deltaNote);
+        switchFrontBack(selectFront, [this, deltaX, deltaNote](const SequenceEntry& current, const StashEntry& se){
+            return draggedEntry(se._orgEntry, current, deltaX, deltaNote);
+        });
+        return true;
     }
     
     /**
      * Duplicate the selected notes. Select the new duplicated notes.
      */
     void duplicateSelection(){
-        Selections newSel;
+        Sequence::Transaction tr = _seq.begin();
+        std::vector<SequenceEntry> dupEntries;
+        dupEntries.reserve(_sellist.size());
         for(Selections::iterator sit = _sellist.begin(); sit != _sellist.end(); ++sit){
-            SequenceDrummer::SequenceEntry dupEntry = sit->_selSeqItr->second;
-            SeqStorageCItr dupIt = _seq.insert(SeqStoragePair(dupEntry._pos, dupEntry));
-            newSel.push_back({dupIt, dupIt->second});
+            dupEntries.push_back(getEntry(*sit));
+            tr.insert(dupEntries.back());
         }
-        _sellist = std::move(newSel);
+        std::vector<NoteHandle> dupHandles = tr.commit();
+        
+        Selections newSel;
+        for(size_t i = 0; i < dupHandles.size(); ++i){
+            newSel.insert({dupHandles[i], dupEntries[i]});
+        }
+        selAssign(newSel);
     }
     
     /**
@@ -658,8 +1320,8 @@ public:
         if(_sellist.size()>0){
             // TODO : eliminate unnsessary update process
             // Update the mouseDown snap shot
-            for(Selection& s : _sellist){
-                s._mouseDownSnapShot = s._selSeqItr->second;
+            for(SelectionItr sit = _sellist.begin(); sit != _sellist.end(); ++sit){
+                _sellist.updateSnapShot(sit, getEntry(*sit));
             }
 
         }
@@ -672,27 +1334,13 @@ public:
      */
     bool dragSelected(float deltaX, int deltaNote){
         if(_sellist.size()>0){
-            //Selections newSet;
+            // All the notes move at once, i.e. audio thread never plays a half-moved selection.
+            Sequence::Transaction tr = _seq.begin();
             for(Selections::iterator sit = _sellist.begin(); sit != _sellist.end(); ++sit){
-                float x = sit->_mouseDownSnapShot._pos - sit->_mouseDownSnapShot._nudge + deltaX;
-                int note = sit->_mouseDownSnapShot._note + deltaNote;
-                int gridId = ::round(x / _seq._gridIntervalDuration); // TODO more intuitive
-
-                Duration gridPos = _seq._gridIntervalDuration * gridId;
-                Duration actPos  = gridPos + sit->_mouseDownSnapShot._nudge;
-                                
-                // No longer need to care about insertion position as it is done automatically be multiset
-                {
-                    SequenceDrummer::SequenceEntry newEntry = sit->_selSeqItr->second;
-                    newEntry._pos = actPos;
-                    newEntry._nudge = sit->_mouseDownSnapShot._nudge; // same nudge value
-                    newEntry._note = note;
-                    
-                    // Renew the sequence
-                    _seq.erase(sit->_selSeqItr);
-                    sit->_selSeqItr = _seq.insert(SeqStoragePair(newEntry._pos, newEntry)); // New iterator
-                }
+                // Position update. The handle stays as is.
+                tr.update(sit->_handle, draggedEntry(sit->_mouseDownSnapShot, getEntry(*sit), deltaX, deltaNote));
             }
+            tr.commit();
             
             return true;
         }
@@ -704,15 +1352,8 @@ public:
      * Make sure to call fixSelection to update the copy of SequenceEntry data  to the latest ones.
      */
     bool copyAndDragSelected(float deltaX, int deltaNote){
-
-        Selections newSel;
-        for(Selections::iterator sit = _sellist.begin(); sit != _sellist.end(); ++sit){
-            SequenceDrummer::SequenceEntry dupEntry = sit->_selSeqItr->second; // This is lock free as const iterator and iterator validity holds due to carefull mechanism.
-            SeqStorageItr dupIt = _seq.insert(SeqStoragePair(dupEntry._pos, dupEntry));
-            newSel.push_back({dupIt, dupIt->second});
-        }
-            
-        return true;
+        duplicateSelection();
+        return dragSelected(deltaX, deltaNote);
     }
     
     /**
@@ -722,9 +1363,11 @@ public:
     bool changeDurationSelected(Duration deltaDuration){
         if(_sellist.size()>0){
             // No need to update sellist as duration change does not affect the order of SequenceEntry.
+            Sequence::Transaction tr = _seq.begin();
             for(SelectionItr sit = _sellist.begin(); sit != _sellist.end(); ++sit ){
-                _seq.updateDuration(sit->_selSeqItr, jmax(Durations::TICK, sit->_mouseDownSnapShot._duration + deltaDuration));
+                tr.updateDuration(sit->_handle, jmax(Durations::TICK, sit->_mouseDownSnapShot._duration + deltaDuration));
             }
+            tr.commit();
             
             return true;
         }
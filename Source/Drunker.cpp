@@ -61,6 +61,9 @@ DrunkerProcessor::DrunkerProcessor()
         NormalisableRange<float> nr(5,990,0.0001);
         _paramMan->addParam(new AudioParameterFloat("Tempo","tempo", nr, InternalParam::defaultTempo), ParameterManager::TEMPO_PARAM, true);
     }
+    {
+        _paramMan->addParam(new AudioParameterBool("Lookahead","lookahead", false), ParameterManager::LOOKAHEAD_PARAM, true);
+    }
 }
 
 DrunkerProcessor::~DrunkerProcessor()
@@ -77,6 +80,11 @@ void DrunkerProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
     ignoreUnused (samplesPerBlock);
     
     _drummer->prepareToPlay(sampleRate);
+    
+    // Initial lookahead with the current tempo. It is followed by handleAsyncUpdate when the tempo changes.
+    int lookahead = _paramMan->getBool(ParameterManager::LOOKAHEAD_PARAM) ? Drummer::withLookaheadHeadroom(_drummer->lookaheadSamplesFor(_paramMan->getFloat(ParameterManager::TEMPO_PARAM))) : 0;
+    _drummer->setLookaheadSamples(lookahead);
+    setLatencySamples(lookahead);
 }
 
 void DrunkerProcessor::releaseResources() {}
@@ -99,6 +107,20 @@ void DrunkerProcessor::processBlock (AudioBuffer<float>& buffer, MidiBuffer& mid
     _drummer->processBlock(numSamples, cp, midi, updateUI);
     
     if(updateUI) sendChangeMessage(); // Upate UI update asynchrnously
+    // Recorded notes are committed, latency is reported, and the start / stop is delivered to the GUI, in the message thread
+    if(updateUI || _drummer->isLookaheadUpdateNeeded() || _drummer->isPlayheadChangePending()) triggerAsyncUpdate();
+}
+
+void DrunkerProcessor::handleAsyncUpdate()
+{
+    _drummer->commitRecorded();
+    if(_drummer->isLookaheadUpdateNeeded()){
+        // Report first, and then apply it to the scheduler.
+        int lookahead = _drummer->getRequiredLookaheadSamples();
+        setLatencySamples(lookahead);
+        _drummer->setLookaheadSamples(lookahead);
+    }
+    _drummer->dispatchPlayheadChange();
 }
 
 AudioProcessorEditor* DrunkerProcessor::createEditor()
@@ -54,7 +54,7 @@
 #include "DrunkerEditor.h"
 
 //==============================================================================
-class DrunkerProcessor  : public AudioProcessor, public ChangeBroadcaster
+class DrunkerProcessor  : public AudioProcessor, public ChangeBroadcaster, private AsyncUpdater
 {
 public:
 
@@ -100,6 +100,10 @@ public:
     void setStateInformation (const void* data, int sizeInBytes) override;
 
 private:
+    //==============================================================================
+    void handleAsyncUpdate() override;
+    
+
     //==============================================================================
     //AudioParameterFloat* speed;
     std::unique_ptr<Drummer> _drummer;
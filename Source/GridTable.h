@@ -0,0 +1,157 @@
+/*
+  ==============================================================================
+
+    GridTable.h
+    Created: 19 Oct 2026 4:58:20pm
+    Author:  Hiroyuki Baba
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Common.h"
+
+/**
+ * Grid of 1/div beat (BEAT4/div interval) for div = 1 - 16.
+ * BEAT4 is divisible by all of them, hence snapping and on-grid judgement are exact in integer.
+ * Tables are generated at compile time.
+ */
+namespace GridTable {
+    constexpr int minDivision = 1;
+    constexpr int maxDivision = 16;
+
+    typedef uint16 Mask; // bit (div-1) is set if on the 1/div grid
+
+    struct Tables{
+        Duration _interval[maxDivision+1];
+        Mask _divisibleBy[maxDivision+1]; // [k] : divisions which are multiple of k, i.e. grids which contain the 1/k grid
+    };
+
+    constexpr Tables makeTables(){
+        Tables t{};
+        for(int d = minDivision; d <= maxDivision; ++d){
+            t._interval[d] = Durations::BEAT4 / d;
+            for(int k = 1; k <= d; ++k){
+                if(d % k == 0) t._divisibleBy[k] |= (Mask)(1 << (d-1));
+            }
+        }
+        return t;
+    }
+    constexpr Tables tables = makeTables();
+
+    constexpr Duration gcd(Duration a, Duration b){
+        while(b != 0){ Duration r = a % b; a = b; b = r; }
+        return a;
+    }
+
+    constexpr Duration interval(int div){ return tables._interval[div]; }
+
+    /**
+     * Grids the grid position belongs to.
+     * The position is on the 1/div grid iff BEAT4 / gcd(pos, BEAT4) divides div, hence one gcd instead of per division modulo.
+     */
+    inline Mask membership(Duration gridPos){
+        Duration r = gridPos % Durations::BEAT4;
+        if(r < 0) r += Durations::BEAT4;
+        Duration k = Durations::BEAT4 / gcd(r, Durations::BEAT4); // gcd(0, BEAT4) = BEAT4
+        return k <= maxDivision ? tables._divisibleBy[k] : 0;
+    }
+
+    inline bool isOnGrid(Mask m, int div){ return (m >> (div-1)) & 1; }
+
+    // Nearest grid position. Integer only. Ties go to the later one.
+    inline Duration snap(Duration x, int div){
+        Duration iv = interval(div);
+        Duration r = x % iv;
+        if(r < 0) r += iv;
+        return x - r + (r * 2 >= iv ? iv : 0);
+    }
+
+    // Division of the interval, e.g. BEAT8 -> 2
+    inline int divisionOf(Duration gridInterval){
+        return jlimit(minDivision, maxDivision, (int)(Durations::BEAT4 / gridInterval));
+    }
+}
+
+/**
+ * Division per beat, e.g. "beat 1 in 5, beat 2 in 7, beats 3-4 in 16ths". 0 means the global division.
+ * A beat boundary is on every grid, so snapping within a beat is the plain integer snap of the beat's division (no search needed).
+ * Sorted grid positions over the loop are cached for drawing, and rebuilt only when the map, the length or the global division changes.
+ */
+class BeatGridMap
+{
+    std::vector<uint8> _division; // Indexed by beat (BEAT4) from the loop start
+
+    std::vector<Duration> _lines;
+    Duration _linesLength;
+    int _linesGlobalDivision;
+    bool _linesDirty;
+
+public:
+    BeatGridMap() : _linesLength(0), _linesGlobalDivision(0), _linesDirty(true) {}
+
+    static int64 BeatOf(Duration pos){
+        return pos >= 0 ? pos / Durations::BEAT4 : -((-pos + Durations::BEAT4 - 1) / Durations::BEAT4);
+    }
+
+    int getBeatDivision(int64 beat) const {
+        return (beat >= 0 && beat < (int64)_division.size()) ? _division[beat] : 0;
+    }
+    void setBeatDivision(int64 beat, int div){
+        if(beat < 0) return;
+        if(beat >= (int64)_division.size()) _division.resize(beat + 1, 0);
+        _division[beat] = (uint8)(div == 0 ? 0 : jlimit(GridTable::minDivision, GridTable::maxDivision, div));
+        while(_division.size() > 0 && _division.back() == 0) _division.pop_back();
+        _linesDirty = true;
+    }
+    void clear(){
+        _division.clear();
+        _linesDirty = true;
+    }
+
+    int effectiveDivision(Duration pos, int globalDivision) const {
+        int div = getBeatDivision(BeatOf(pos));
+        return div != 0 ? div : globalDivision;
+    }
+    Duration snap(Duration x, int globalDivision) const {
+        return GridTable::snap(x, effectiveDivision(x, globalDivision));
+    }
+    bool isOnGrid(Duration gridPos, GridTable::Mask m, int globalDivision) const {
+        return GridTable::isOnGrid(m, effectiveDivision(gridPos, globalDivision));
+    }
+
+    // Grid positions in [0, length], sorted.
+    const std::vector<Duration>& getLines(Duration length, int globalDivision){
+        if(_linesDirty || _linesLength != length || _linesGlobalDivision != globalDivision){
+            _lines.clear();
+            for(Duration beatStart = 0; beatStart < length; beatStart += Durations::BEAT4){
+                int div = effectiveDivision(beatStart, globalDivision);
+                Duration iv = GridTable::interval(div);
+                for(Duration p = beatStart; p < beatStart + Durations::BEAT4 && p < length; p += iv) _lines.push_back(p);
+            }
+            _lines.push_back(length);
+            _linesLength = length;
+            _linesGlobalDivision = globalDivision;
+            _linesDirty = false;
+        }
+        return _lines;
+    }
+
+    void serialize(MemoryOutputStream& outputStream) const {
+        outputStream.writeInt((int)_division.size());
+        for(uint8 d : _division) outputStream.writeByte((char)d);
+    }
+    void deserialize(MemoryInputStream& inputStream){
+        int n = inputStream.readInt();
+        if(n < 0 || n > inputStream.getNumBytesRemaining()){
+            jassertfalse; // Corrupted data
+            clear();
+            return;
+        }
+        _division.resize(n);
+        for(int i = 0; i < n; ++i) _division[i] = (uint8)inputStream.readByte();
+        _linesDirty = true;
+    }
+};
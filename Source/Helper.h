@@ -9,6 +9,7 @@
 */
 
 #pragma once
+#include "Common.h"
 
 inline void FMT(String& s) {}
 
@@ -65,18 +66,20 @@ T mod(T v1, T v2){
 }
 
 //==============================================================================
-/*
-*/
+/**
+ * Linear mapping between the model (Duration, pitch) and the screen coordinate, defined by the ranges and the reference rectangle.
+ * Coefficients are cached, and re-computed only by xrange(), yrange() and refRectChanged().
+ */
 class ViewConverter
 {
     Rectangle<int>& viewScreenBox;
 public:
     ViewConverter(Rectangle<int>& refRect) :
-    viewScreenBox(refRect), _min_x(-1), _max_x(1), _min_y(-1), _max_y(1)
+    viewScreenBox(refRect)
     {
         // In your constructor, you should add any child components, and
         // initialise any special settings that your component needs.
-
+        updateCoefficients(); // Last, after all the ranges are set.
     }
     
     std::pair<float,float> convToScreen(float x, float y) const {
@@ -87,28 +90,19 @@ public:
     }
     
     float convToScreenX(float x) const {
-        
-        float ax = viewScreenBox.getWidth() / (_max_x - _min_x);
-        float bx = viewScreenBox.getX() - ax * _min_x;
-        
-        return ax * x + bx;;
+        return _ax * x + _bx;
     }
     
     float convToScreenY(float y) const {
-                
-        float ay = viewScreenBox.getHeight() / (_min_y - _max_y); // y-axis is inverted
-        float by = viewScreenBox.getY() - ay * _max_y;
-        return ay * y + by;
+        return _ay * y + _by; // y-axis is inverted
     }
     
     float convToScreenWidth(float w) const {
-        float ax = viewScreenBox.getWidth() / (_max_x - _min_x);
-        return ax * w;
+        return _ax * w;
     }
     
     float convToScreenHeight(float h) const {
-        float ay = viewScreenBox.getHeight() / (_min_y - _max_y); // y-axis is inverted
-        return ay * h;
+        return _ay * h;
     }
     
     std::pair<float,float> convFromScreen(float x, float y) const {
@@ -119,44 +113,55 @@ public:
     }
     
     float convFromScreenX(float x) const {
-
-        float ax = viewScreenBox.getWidth() / (_max_x - _min_x);
-        float bx = viewScreenBox.getX() - ax * _min_x;
-
-        return (x - bx)/ax;
+        return (x - _bx)/_ax;
     }
     
     float convFromScreenY(float y) const {
-                
-        float ay = viewScreenBox.getHeight() / (_min_y - _max_y); // y-axis is inverted
-        float by = viewScreenBox.getY() - ay * _max_y;
-        return (y - by)/ay;
+        return (y - _by)/_ay;
     }
     
     float convFromScreenWidth(float w) const {
-
-        float ax = viewScreenBox.getWidth() / (_max_x - _min_x);
-        //float bx = viewScreenBox.getX() - ax * _min_x;
-
-        return w/ax;
+        return w/_ax;
     }
     
     float convFromScreenHeight(float h) const {
-                
-        float ay = viewScreenBox.getHeight() / (_min_y - _max_y); // y-axis is inverted
-        //float by = viewScreenBox.getY() - ay * _max_y;
-        return h/ay;
+        return h/_ay;
+    }
+    
+    /**
+     * Batch conversion of the notes : x of the grid position, y of the upper end of the row (pitch + 1) and width of the duration.
+     * One pass over the arrays with the coefficients held in locals and no branch, so that the compiler can vectorize it.
+     */
+    void convNotesToScreen(const Duration* gridPos, const Duration* duration, const int* note, size_t n,
+                           float* outX, float* outY, float* outW) const {
+        const float ax = _ax, bx = _bx, ay = _ay, by = _by;
+        for(size_t i = 0; i < n; ++i){
+            outX[i] = ax * (float)gridPos[i] + bx;
+            outY[i] = ay * (float)(note[i] + 1) + by;
+            outW[i] = ax * (float)duration[i];
+        }
+    }
+    // Same pass for the positions only, e.g. the actual (nudged) positions.
+    void convToScreenX(const Duration* x, size_t n, float* out) const {
+        const float ax = _ax, bx = _bx;
+        for(size_t i = 0; i < n; ++i) out[i] = ax * (float)x[i] + bx;
     }
-
 
     void xrange(float min_x, float max_x){
         _min_x = min_x;
         _max_x = max_x;
+        updateCoefficients();
     }
     
     void yrange(float min_y, float max_y){
         _min_y = min_y;
         _max_y = max_y;
+        updateCoefficients();
+    }
+    
+    // Call after the reference rectangle is changed.
+    void refRectChanged(){
+        updateCoefficients();
     }
     
     const Rectangle<int>& getRefRect() const {
@@ -165,13 +170,344 @@ public:
     
 private:
     
-    float _min_x, _max_x;
-    float _min_y, _max_y;
+    float _min_x = -1, _max_x = 1;
+    float _min_y = -1, _max_y = 1;
+    float _ax = 0, _bx = 0; // screen x = _ax * x + _bx
+    float _ay = 0, _by = 0; // screen y = _ay * y + _by
+    
+    void updateCoefficients(){
+        _ax = viewScreenBox.getWidth() / (_max_x - _min_x);
+        _bx = viewScreenBox.getX() - _ax * _min_x;
+        _ay = viewScreenBox.getHeight() / (_min_y - _max_y); // y-axis is inverted
+        _by = viewScreenBox.getY() - _ay * _max_y;
+    }
 
 private:
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ViewConverter)
 };
 
+/**
+ * Cache of a static layer (e.g. background rows and grid lines) rasterized into fixed size tiles in the component coordinate.
+ * Tiles are rendered on demand at the physical pixel scale of the context, and blitted until the key or the scale changes.
+ * Key is any set of values the layer depends on, e.g. zoom, grid and loop length.
+ */
+class TiledLayerCache
+{
+public:
+    static const int tileSize = 256;
+    static const size_t maxTiles = 64; // Least recently drawn tiles are dropped beyond this.
+    
+    TiledLayerCache() : _scale(0.0f), _drawCount(0) {}
+    
+    void setKey(const std::vector<double>& key){
+        if(key != _key){
+            _key = key;
+            invalidate();
+        }
+    }
+    void invalidate(){ _tiles.clear(); }
+    
+    // render draws the layer in the component coordinate. Clip is set to the tile, so that it can cull by getClipBounds().
+    void draw(Graphics& g, const std::function<void(Graphics&)>& render){
+        float scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+        if(scale != _scale){
+            _scale = scale;
+            invalidate();
+        }
+        
+        ++_drawCount;
+        Rectangle<int> clip = g.getClipBounds();
+        int tx0 = floorDiv(clip.getX(), tileSize), tx1 = floorDiv(clip.getRight() - 1, tileSize);
+        int ty0 = floorDiv(clip.getY(), tileSize), ty1 = floorDiv(clip.getBottom() - 1, tileSize);
+        for(int ty = ty0; ty <= ty1; ++ty){
+            for(int tx = tx0; tx <= tx1; ++tx){
+                Tile& t = _tiles[{tx, ty}];
+                t._lastUsed = _drawCount;
+                Image& tile = t._image;
+                if(tile.isNull()){
+                    int px = (int)std::ceil(tileSize * _scale);
+                    tile = Image(Image::RGB, px, px, true);
+                    Graphics tg(tile);
+                    tg.addTransform(AffineTransform::translation((float)(-tx * tileSize), (float)(-ty * tileSize)).scaled(_scale));
+                    render(tg);
+                }
+                g.drawImage(tile, Rectangle<float>((float)(tx * tileSize), (float)(ty * tileSize), (float)tileSize, (float)tileSize));
+            }
+        }
+        
+        // LRU, not by the clip. A small dirty rect repaint must not drop the tiles still on screen.
+        if(_tiles.size() > maxTiles){
+            std::vector<std::pair<uint64, std::pair<int,int>>> byAge;
+            byAge.reserve(_tiles.size());
+            for(const auto& t : _tiles) byAge.push_back({t.second._lastUsed, t.first});
+            std::sort(byAge.begin(), byAge.end());
+            for(size_t i = 0; i < byAge.size() - maxTiles && byAge[i].first != _drawCount; ++i) _tiles.erase(byAge[i].second);
+        }
+    }
+    
+private:
+    static int floorDiv(int a, int b){ return a >= 0 ? a / b : -((-a + b - 1) / b); }
+    
+    struct Tile{
+        Image _image;
+        uint64 _lastUsed = 0; // _drawCount of the last draw
+    };
+    std::map<std::pair<int,int>, Tile> _tiles;
+    std::vector<double> _key;
+    float _scale;
+    uint64 _drawCount;
+    
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (TiledLayerCache)
+};
+
+/**
+ * Tiled layer rasterized by worker threads.
+ * The content is given as a renderer which must be safe to call from any thread, i.e. it draws from an immutable snapshot only.
+ * Only the tiles intersecting with the dirty area of a content change are re-queued, and the current image stays in place until the new one is ready.
+ * A finished tile always replaces an older one, hence a continuous edit (e.g. drag) still shows the progress.
+ * The message thread never rasterizes. Until a missing tile is ready, the tiles of the previous geometry are drawn scaled in place, if any.
+ */
+class AsyncTiledLayer
+{
+public:
+    typedef std::function<void(Graphics&)> Renderer;
+    static const int tileSize = 256;
+    static const size_t maxTiles = 64; // Least recently drawn tiles are dropped beyond this.
+    
+    // onTileReady : called in the message thread with the finished tile area in the layer coordinate.
+    AsyncTiledLayer(std::function<void(Rectangle<int>)> onTileReady) : _shared(std::make_shared<Shared>()), _scale(0.0f), _version(0), _requiredAll(0), _drawCount(0) {
+        _shared->_onTileReady = onTileReady;
+    }
+    ~AsyncTiledLayer(){
+        _shared->_alive = false; // Jobs in flight finish into the orphaned state
+    }
+    
+    /**
+     * Tiles are dropped when the geometry (e.g. zoom) changes.
+     * oldToNew maps the layer coordinate of the previous geometry to the new one, so that the dropped tiles can be shown scaled meanwhile.
+     */
+    void setGeometryKey(const std::vector<double>& key, const AffineTransform& oldToNew){
+        if(key != _geometryKey){
+            _geometryKey = key;
+            keepPlaceholders(oldToNew);
+            dropTiles();
+        }
+    }
+    // New content, which differs from the current one only within dirty (layer coordinate).
+    void setContent(std::shared_ptr<const Renderer> renderer, const std::vector<Rectangle<int>>& dirty){
+        _renderer = renderer;
+        ++_version;
+        std::lock_guard<std::mutex> lock(_shared->_mtx);
+        for(const Rectangle<int>& r : dirty){
+            for(int ty = floorDiv(r.getY(), tileSize); ty <= floorDiv(r.getBottom() - 1, tileSize); ++ty){
+                for(int tx = floorDiv(r.getX(), tileSize); tx <= floorDiv(r.getRight() - 1, tileSize); ++tx){
+                    TileIndex ti{tx, ty};
+                    if(_shared->_tiles.count(ti) > 0 || _shared->_requested.count(ti) > 0) _required[ti] = _version;
+                }
+            }
+        }
+    }
+    // New content, all changed.
+    void setContent(std::shared_ptr<const Renderer> renderer){
+        _renderer = renderer;
+        _requiredAll = ++_version;
+        _required.clear();
+    }
+    
+    void draw(Graphics& g){
+        float scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+        if(scale != _scale){
+            // Tiles of the old scale are still right in the layer coordinate. Kept in place until re-rendered.
+            _scale = scale;
+            std::lock_guard<std::mutex> lock(_shared->_mtx);
+            ++_shared->_epoch;
+            _shared->_requested.clear();
+            _requiredAll = ++_version;
+            _required.clear();
+        }
+        if(_renderer == nullptr) return;
+        
+        ++_drawCount;
+        Rectangle<int> clip = g.getClipBounds();
+        int tx0 = floorDiv(clip.getX(), tileSize), tx1 = floorDiv(clip.getRight() - 1, tileSize);
+        int ty0 = floorDiv(clip.getY(), tileSize), ty1 = floorDiv(clip.getBottom() - 1, tileSize);
+        
+        bool anyMissing = false;
+        std::lock_guard<std::mutex> lock(_shared->_mtx);
+        for(int ty = ty0; ty <= ty1; ++ty){
+            for(int tx = tx0; tx <= tx1; ++tx){
+                TileIndex ti{tx, ty};
+                Rectangle<float> area((float)(tx * tileSize), (float)(ty * tileSize), (float)tileSize, (float)tileSize);
+                auto it = _shared->_tiles.find(ti);
+                uint64 required = requiredVersion(ti);
+                if(it != _shared->_tiles.end() && it->second._version >= required){
+                    _required.erase(ti);
+                }else{
+                    auto rq = _shared->_requested.find(ti);
+                    if(rq == _shared->_requested.end() || rq->second < required){
+                        _shared->_requested[ti] = _version;
+                        _pool->_pool.addJob(new RasterJob(_shared, _renderer, ti, _scale, _version, _shared->_epoch), true);
+                    }
+                }
+                
+                if(it != _shared->_tiles.end()){
+                    it->second._lastUsed = _drawCount;
+                    g.drawImage(it->second._image, area);
+                }else{
+                    anyMissing = true;
+                    g.saveState();
+                    g.reduceClipRegion(area.getSmallestIntegerContainer());
+                    for(const Placeholder& p : _placeholders){
+                        if(p._area.intersects(area)) g.drawImage(p._image, p._area);
+                    }
+                    g.restoreState();
+                }
+            }
+        }
+        if(!anyMissing && _shared->_requested.empty()) _placeholders.clear(); // All the tiles asked for have arrived
+        
+        // LRU, not by the clip. A small dirty rect repaint must not drop the tiles still on screen.
+        if(_shared->_tiles.size() > maxTiles){
+            std::vector<std::pair<uint64, TileIndex>> byAge;
+            byAge.reserve(_shared->_tiles.size());
+            for(const auto& t : _shared->_tiles) byAge.push_back({t.second._lastUsed, t.first});
+            std::sort(byAge.begin(), byAge.end());
+            for(size_t i = 0; i < byAge.size() - maxTiles && byAge[i].first != _drawCount; ++i){
+                _shared->_tiles.erase(byAge[i].second);
+                _required.erase(byAge[i].second);
+            }
+        }
+    }
+    
+private:
+    typedef std::pair<int,int> TileIndex;
+    struct Tile{
+        Image _image;
+        uint64 _version = 0; // Content version rendered from
+        uint64 _lastUsed = 0; // Message thread only
+    };
+    
+    // Shared with the jobs, so that a job can outlive the layer.
+    struct Shared{
+        std::mutex _mtx;
+        std::map<TileIndex, Tile> _tiles; // Guarded by _mtx
+        std::map<TileIndex, uint64> _requested; // Latest version queued per tile. Guarded by _mtx
+        uint64 _epoch = 0; // Bumped by the geometry changes. Jobs of an old epoch are discarded. Guarded by _mtx
+        std::function<void(Rectangle<int>)> _onTileReady; // Message thread only
+        bool _alive = true; // Message thread only
+        
+        // Newer one wins, whichever finishes first. Shall be called with _mtx.
+        bool store(TileIndex ti, const Image& image, uint64 version){
+            auto it = _tiles.find(ti);
+            if(it != _tiles.end() && it->second._version >= version) return false;
+            Tile& tile = _tiles[ti];
+            tile._image = image;
+            tile._version = version;
+            return true;
+        }
+    };
+    
+    struct RasterPool{
+        ThreadPool _pool{ jmax(1, SystemStats::getNumCpus() - 1) };
+    };
+    
+    // Tile of the previous geometry, in the current layer coordinate.
+    struct Placeholder{
+        Rectangle<float> _area;
+        Image _image;
+    };
+    
+    static Image rasterize(const Renderer& renderer, TileIndex ti, float scale){
+        int px = (int)std::ceil(tileSize * scale);
+        Image image(Image::ARGB, px, px, true, SoftwareImageType());
+        Graphics tg(image);
+        tg.addTransform(AffineTransform::translation((float)(-ti.first * tileSize), (float)(-ti.second * tileSize)).scaled(scale));
+        renderer(tg);
+        return image;
+    }
+    
+    class RasterJob : public ThreadPoolJob{
+        std::shared_ptr<Shared> _shared;
+        std::shared_ptr<const Renderer> _renderer;
+        TileIndex _ti;
+        float _scale;
+        uint64 _version;
+        uint64 _epoch;
+        
+        // Superseded while waiting in the queue. Jobs already running are not, and finish into the tile.
+        bool isObsolete(){
+            std::lock_guard<std::mutex> lock(_shared->_mtx);
+            auto rq = _shared->_requested.find(_ti);
+            return _shared->_epoch != _epoch || rq == _shared->_requested.end() || rq->second > _version;
+        }
+    public:
+        RasterJob(std::shared_ptr<Shared> shared, std::shared_ptr<const Renderer> renderer, TileIndex ti, float scale, uint64 version, uint64 epoch)
+        : ThreadPoolJob("RasterJob"), _shared(shared), _renderer(renderer), _ti(ti), _scale(scale), _version(version), _epoch(epoch) {}
+        
+        virtual JobStatus runJob() override {
+            if(shouldExit() || isObsolete()) return jobHasFinished;
+            
+            Image image = rasterize(*_renderer, _ti, _scale);
+            {
+                std::lock_guard<std::mutex> lock(_shared->_mtx);
+                if(_shared->_epoch != _epoch) return jobHasFinished;
+                auto rq = _shared->_requested.find(_ti);
+                if(rq != _shared->_requested.end() && rq->second == _version) _shared->_requested.erase(rq);
+                if(!_shared->store(_ti, image, _version)) return jobHasFinished;
+            }
+            
+            std::weak_ptr<Shared> weak = _shared;
+            Rectangle<int> area(_ti.first * tileSize, _ti.second * tileSize, tileSize, tileSize);
+            MessageManager::callAsync([weak, area](){
+                std::shared_ptr<Shared> shared = weak.lock();
+                if(shared != nullptr && shared->_alive) shared->_onTileReady(area);
+            });
+            return jobHasFinished;
+        }
+    };
+    
+    static int floorDiv(int a, int b){ return a >= 0 ? a / b : -((-a + b - 1) / b); }
+    
+    uint64 requiredVersion(TileIndex ti) const {
+        auto it = _required.find(ti);
+        return it != _required.end() ? jmax(_requiredAll, it->second) : _requiredAll;
+    }
+    
+    // Placeholders are carried over the successive changes (e.g. during a zoom drag), up to maxTiles.
+    void keepPlaceholders(const AffineTransform& oldToNew){
+        for(Placeholder& p : _placeholders) p._area = p._area.transformedBy(oldToNew);
+        std::lock_guard<std::mutex> lock(_shared->_mtx);
+        for(const auto& t : _shared->_tiles){
+            Rectangle<float> area((float)(t.first.first * tileSize), (float)(t.first.second * tileSize), (float)tileSize, (float)tileSize);
+            _placeholders.push_back({area.transformedBy(oldToNew), t.second._image});
+        }
+        if(_placeholders.size() > maxTiles) _placeholders.erase(_placeholders.begin(), _placeholders.end() - maxTiles);
+    }
+    
+    void dropTiles(){
+        std::lock_guard<std::mutex> lock(_shared->_mtx);
+        ++_shared->_epoch;
+        _shared->_tiles.clear();
+        _shared->_requested.clear();
+        _required.clear();
+    }
+    
+    std::shared_ptr<Shared> _shared;
+    SharedResourcePointer<RasterPool> _pool;
+    std::shared_ptr<const Renderer> _renderer;
+    std::vector<double> _geometryKey;
+    float _scale;
+    
+    // Content versions. Message thread only.
+    uint64 _version; // Of the current renderer
+    uint64 _requiredAll; // Every tile shall be at least this version
+    std::map<TileIndex, uint64> _required; // Tiles which shall be newer than _requiredAll, by the dirty areas
+    uint64 _drawCount;
+    std::vector<Placeholder> _placeholders; // Message thread only
+    
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (AsyncTiledLayer)
+};
+
 class ParameterManager
 {
     class Callback : public AudioProcessorParameter::Listener {
@@ -232,6 +568,7 @@ public:
     static const int PLAYSTOP_PARAM = 6;
     static const int TEMPO_PARAM = 7;
     static const int RECORD_PARAM = 8;
+    static const int LOOKAHEAD_PARAM = 9;
     
     
 
@@ -352,6 +689,7 @@ public:
         return instance;
     }
     static const int ON_LOOP_END_CHANGE = 0;
+    static const int ON_GRID_MAP_CHANGE = 1;
     void addCallback(int channel, Func cb){
         std::lock_guard<std::mutex> lock(_mtx);
         _cbs.push_back( std::make_pair(channel, cb));
@@ -381,6 +719,7 @@ private:
 /**
  * Utiltity class which realize a mouse dragging with infinite bounds for upper and lower distance.
  * When the mouse goes below or above the reference component's area, then mouse is virtually moves go further with the velocity proporational to the distance of the mouse point and the edge of the reference component, and virtual drag event will be issued periodically.
+ * The timer runs only while the mouse is outside the reference area during a drag.
  */
 class InfiniteDragger : public Timer, public MouseListener
 {
@@ -419,7 +758,6 @@ protected:
     const double _dragSpeedCoeff = 5.0;
 public:
     InfiniteDragger(const Component* refCompX, const Component* refCompY) : _refCompX(refCompX), _refCompY(refCompY){
-        startTimer(_timerPeriodMS);
     }
     
     ~InfiniteDragger(){
@@ -450,6 +788,7 @@ public:
         _scrollStrengthY = 0;
         _culmativeAutoScrollX = 0;
         _culmativeAutoScrollY = 0;
+        stopTimer();
         for(int i = 0; i < _listeners.size(); ++i)
             _listeners[i]->onPeriodicDragEnd(dragX, dragY);
     }
@@ -488,6 +827,12 @@ public:
         
         }
         
+        if(_outsideX || _outsideY){
+            if(!isTimerRunning()) startTimer(_timerPeriodMS);
+        }else{
+            stopTimer();
+        }
+        
         publishDragEvent();
     }
 
@@ -30,11 +30,12 @@ void LoopEndIndicator::onPeriodicDrag(int distX, int distY){
         getParentComponent()->repaint();
         
         MessageChannel::getInstance().notify(MessageChannel::ON_LOOP_END_CHANGE);
+        sd.notifyChanges();
     }else if(seq.getLength() > candLength){
         // We do not immediately change the length, but show the dammy indicator to specify the length
         _dammy->setVisible(true);
         _dammy->setAlwaysOnTop(true);
-        _dammy->setTopLeftPosition(_conv->convToScreenX(candLength), 0);
+        _dammy->setTopLeftPosition(_conv->convToScreenX(candLength) - _prcv.getScrollX(), 0);
         _prcv.scrollToIfInvisible(candLength);
     }else{
         _dammy->setVisible(false);
@@ -60,6 +61,7 @@ void LoopEndIndicator::onPeriodicDragEnd(int distX, int distY){
         getParentComponent()->repaint();
         
         MessageChannel::getInstance().notify(MessageChannel::ON_LOOP_END_CHANGE);
+        sd.notifyChanges();
     }
 }
 
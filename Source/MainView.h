@@ -13,6 +13,7 @@
 #include <JuceHeader.h>
 #include "Common.h"
 #include "Drummer.h"
+#include "PatternTransform.h"
 #include "colormap.h"
 #include <set>
 #include "ScrollingView.h"
@@ -30,11 +31,29 @@ class PianoRollTimeRuler : public HScrollingView
 public:
     PianoRollTimeRuler(ScrollBar& hScrollBar, Drummer& drummer, ViewConverter* conv) : HScrollingView(hScrollBar), _drummer(drummer), _conv(conv)
     {
+        getScolloingContainer()->addMouseListener(this, false);
+    }
+    virtual ~PianoRollTimeRuler(){
+        getScolloingContainer()->removeMouseListener(this);
+    }
+    
+    // Alt + click on a beat : assign the current grid division to the beat. Click again to follow the global one.
+    virtual void mouseDown(const MouseEvent& event) override {
+        if(event.eventComponent != getScolloingContainer() || !event.mods.isAltDown()) return;
+        SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
+        SequenceDrummer::Sequence& seq = sd.getSequence();
+        Duration pos = _conv->convFromScreenX(toContent(event.getPosition()).x);
+        if(pos < 0 || pos >= seq.getLength()) return;
+        
+        int64 beat = BeatGridMap::BeatOf(pos);
+        int div = seq.gridDivision();
+        seq.setBeatDivision(beat, seq._beatGrid.getBeatDivision(beat) == div ? 0 : div);
+        repaint();
+        MessageChannel::getInstance().notify(MessageChannel::ON_GRID_MAP_CHANGE);
+        sd.notifyChanges();
     }
-    virtual ~PianoRollTimeRuler(){}
     virtual void resized() override{
-        Rectangle<int> lb = getLocalBounds();
-        getScolloingContainer()->setBounds(applySizeIfBigger(getContentSize(), lb));
+        getScolloingContainer()->setBounds(getLocalBounds());
     }
     Rectangle<int> getContentSize(){
         SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
@@ -43,40 +62,105 @@ public:
         cs.setHeight(InternalParam::pianoRollTopTimeRulerHeight);
         return cs;
     }
+    // Beat lines and labels are rasterized once, and re-used until the zoom, the length or the beat grid is changed.
     virtual void scrollViewPaint(Graphics& g) override {
+        SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
+        SequenceDrummer::Sequence& seq = sd.getSequence();
+        _cache.setKey({_conv->convToScreenX(0), _conv->convToScreenWidth(Durations::BEAT4), (double)seq.getLength(), (double)seq.gridVersion(), (double)getHeight()});
+        _cache.draw(g, [this](Graphics& rg){ paintRuler(rg); });
+    }
+private:
+    TiledLayerCache _cache;
+    
+    void paintRuler(Graphics& g){
         SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
         SequenceDrummer::Sequence& seq = sd.getSequence();
         Rectangle<int> lb = getLocalBounds();
         g.fillAll(ColourParam::timeRulerBG);
 
-        int n = 1;
-        for(Duration d = 0; d <= seq.getLength(); d += Durations::BEAT4){
+        // Beats from the one whose label (30px) can reach the clip region
+        Rectangle<int> clip = g.getClipBounds();
+        int64 firstBeat = jmax(int64(0), BeatGridMap::BeatOf((Duration)_conv->convFromScreenX(clip.getX() - 33)));
+        Duration lastPos = jmin(seq.getLength(), (Duration)_conv->convFromScreenX(clip.getRight() + 2));
+        int n = (int)firstBeat + 1;
+        for(Duration d = firstBeat * Durations::BEAT4; d <= lastPos; d += Durations::BEAT4){
             int x = _conv->convToScreenX(d);
             g.setColour(ColourParam::timeRulerGridLine);
             g.drawLine(x,0,x,lb.getHeight(),3);
             
             g.setColour(ColourParam::labelColour);
             g.drawFittedText(String(n), x + 3, 2, 20, 10, Justification::left, 1);
+            int beatDiv = seq._beatGrid.getBeatDivision(n - 1);
+            if(beatDiv != 0){
+                g.drawFittedText(String("1/") + String(beatDiv), x + 3, 10, 30, 10, Justification::left, 1);
+            }
             ++n;
         }
     }
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PianoRollTimeRuler)
 };
 
-class TimeIndicator : public Component, public Timer
+/**
+ * Playhead drawn as a transparent overlay over the whole scrolling container.
+ * Updated once per display frame (VBlankAttachment, a 60Hz timer before JUCE 7) from the transport snapshot extrapolated to now,
+ * so that it moves smoothly regardless of the audio block size, and only the old and the new 1px columns are repainted.
+ * Frame updates run only while playing. Start / stop is notified by the drummer, hence nothing wakes up while stopped.
+ */
+class TimeIndicator : public Component
+#if JUCE_MAJOR_VERSION < 7
+, public Timer
+#endif
 {
     Drummer& _drummer;
     ViewConverter* _conv;
+    int _x; // In the content coordinate
+    int _scrollX;
+#if JUCE_MAJOR_VERSION >= 7
+    std::unique_ptr<VBlankAttachment> _vblank;
+#endif
+    
+    void update(){
+        int x = _conv->convToScreenX(_drummer.getPlayheadInDuration(Time::getMillisecondCounterHiRes()));
+        if(x == _x) return;
+        repaint(_x - _scrollX, 0, 1, getHeight());
+        repaint(x - _scrollX, 0, 1, getHeight());
+        _x = x;
+    }
+    
+    void onPlayheadChange(bool running){
+#if JUCE_MAJOR_VERSION >= 7
+        if(running) _vblank.reset(new VBlankAttachment(this, [this]{ update(); }));
+        else _vblank.reset();
+#else
+        if(running) startTimerHz(60);
+        else stopTimer();
+#endif
+        update(); // The stopped position, or the first frame
+    }
 public:
-    TimeIndicator(Drummer& drummer, ViewConverter* conv) : _drummer(drummer), _conv(conv) {
-        startTimer(1000/24.0);
+    TimeIndicator(Drummer& drummer, ViewConverter* conv) : _drummer(drummer), _conv(conv), _x(0), _scrollX(0) {
+        setInterceptsMouseClicks(false, false);
+        setOpaque(false);
+        
+        SafePointer<TimeIndicator> safeThis(this);
+        drummer.addPlayheadCallback([safeThis](bool running){
+            if(safeThis != nullptr) safeThis->onPlayheadChange(running);
+        });
+        onPlayheadChange(drummer.isPlayheadRunning());
     }
     virtual ~TimeIndicator(){}
+    void setScrollX(int x){
+        _scrollX = x;
+        repaint();
+    }
+#if JUCE_MAJOR_VERSION < 7
     virtual void timerCallback() override {
-        this->setTopLeftPosition(_conv->convToScreenX(_drummer.getLocalTimeInDuration()), 0);
+        update();
     }
+#endif
     virtual void paint(Graphics& g) override {
-        g.fillAll(Colours::white);
+        g.setColour(Colours::white);
+        g.fillRect(_x - _scrollX, 0, 1, getHeight());
     }
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (TimeIndicator)
 };
@@ -178,58 +262,230 @@ class PianoRollView : public Component
     Point<int> _selStart;
     Rectangle<int> _selRegion;
     SequenceDrummer::Selections _selsOnStart;
+    std::vector<SequenceDrummer::NoteHandle> _regionHits; // Notes in _selRegion, sorted by the slot index
+    std::vector<SequenceDrummer::NoteHandle> _regionWork;
     
     MouseManupilation _mm = MM_NONE;
+    bool _inUndoGroup = false; // Opened by mouseDown of a drag, closed by mouseUp
     
     struct ModifiesKeyState {
         bool altDown = false;
     } _modKeyState;
     
-public:
-    PianoRollView(ParameterManager& pm, Drummer& drummer, ViewConverter* conv) : _drummer(drummer), _pm(pm), _conv(conv){
-        setName("PianoRollContainerView");
-        setWantsKeyboardFocus(true);
+    TiledLayerCache _bgCache; // Rows, grid lines and lane grids.
+    
+    // The view is viewport-sized, and renders the content from this offset. Painting and hit testing are all in the content coordinate.
+    int _scrollX = 0;
+    Point<int> toContent(const MouseEvent& event) const { return event.getPosition().translated(_scrollX, 0); }
+    void repaintContent(const Rectangle<int>& r){ repaint(r.translated(-_scrollX, 0)); }
+    
+    // Notes are collected per colour, and each bucket is filled at once. [0, 128) : velocity, [128, 256) : selected, 256 : off grid (grey).
+    enum { NB_SELECTED = 128, NB_OFF_GRID = 256, NB_NUM = 257 };
+    struct NoteBucket{
+        RectangleList<int> _rects; // Notes without nudge
+        Path _shapes; // Nudged notes
+    };
+    
+    /**
+     * Immutable copy of the notes in the content coordinate with the colour resolved, which the raster threads draw from.
+     * Covers only the notes around the visible area. In the storage order, i.e. sorted by the actual position, so that a tile finds its notes by a binary search.
+     */
+    struct NoteSnapshot{
+        struct Item{
+            float _xGrid;
+            float _xAct;
+            float _w;
+            int _y;
+            int _h;
+            int _bucket;
+            bool _nudged;
+        };
+        std::vector<Item> _items;
+        float _maxExtent = 0; // Max distance from _xAct to the far end of the drawn area
         
-        // GLOBAL_GRID_PARAM needs to be ready at this stage.
-        pm.addCallback(pm.GLOBAL_GRID_PARAM, [this](float v,bool){
-            SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(this->_drummer);
-            SequenceDrummer::Sequence& seq = sd.getSequence();
-            seq._gridIntervalDuration = Durations::BEAT4 / v;
-            this->repaint();
-        });
-    }
+        void render(Graphics& g) const {
+            Rectangle<int> clip = g.getClipBounds();
+            // Reused per raster thread, so that a tile render does not allocate all the buckets. Emptied after use.
+            static thread_local std::vector<NoteBucket> buckets(NB_NUM);
+            static thread_local std::vector<int> usedBuckets;
+            usedBuckets.clear();
+            
+            auto it = std::lower_bound(_items.begin(), _items.end(), clip.getX() - _maxExtent - 2, [](const Item& item, float x){ return item._xAct < x; });
+            for(; it != _items.end() && it->_xAct <= clip.getRight() + _maxExtent + 2; ++it){
+                const Item& e = *it;
+                if(e._y > clip.getBottom() || e._y + e._h < clip.getY()) continue;
+                NoteBucket& nb = buckets[e._bucket];
+                if(nb._rects.isEmpty() && nb._shapes.isEmpty()) usedBuckets.push_back(e._bucket);
+                
+                if(!e._nudged){
+                    nb._rects.addWithoutMerging({(int)e._xGrid, e._y, (int)e._w, e._h});
+                }else{
+                    nb._shapes.startNewSubPath(e._xGrid, e._y);
+                    nb._shapes.lineTo(e._xAct, e._y + e._h/2);
+                    nb._shapes.lineTo(e._xGrid, e._y + e._h);
+                    nb._shapes.lineTo(e._xGrid + e._w, e._y + e._h);
+                    nb._shapes.lineTo(e._xAct + e._w, e._y + e._h/2);
+                    nb._shapes.lineTo(e._xGrid + e._w, e._y);
+                    nb._shapes.closeSubPath();
+                }
+            }
+            
+            // One fill per used colour
+            for(int bucket : usedBuckets){
+                const NoteBucket& nb = buckets[bucket];
+                if(bucket == NB_OFF_GRID)          g.setColour(Colours::grey);
+                else if(bucket >= NB_SELECTED)     g.setColour(Colour(colormap::velocityColours._selected[bucket - NB_SELECTED]));
+                else                               g.setColour(Colour(colormap::velocityColours._normal[bucket]));
+                if(!nb._rects.isEmpty()) g.fillRectList(nb._rects);
+                if(!nb._shapes.isEmpty()) g.fillPath(nb._shapes);
+            }
+            for(int bucket : usedBuckets){
+                buckets[bucket]._rects.clear();
+                buckets[bucket]._shapes.clear();
+            }
+        }
+    };
     
-    virtual ~PianoRollView(){
-        // TODO : Remove callback to pm
-    }
+    // Note layer, rasterized in tiles by the worker threads.
+    // The snapshot is rebuilt when the notes, the geometry or the off grid locking is changed, or the view is scrolled out of its range.
+    AsyncTiledLayer _noteLayer;
+    std::vector<double> _noteGeometry;
+    uint64 _noteRevision = 0; // Incremented by every change set
+    uint64 _noteSnapshotRevision = ~uint64(0);
+    bool _noteLockOffGrid = false;
+    int _noteRangeX0 = 0, _noteRangeX1 = 0; // Content x range covered by the snapshot
+    std::vector<Rectangle<int>> _noteDirty; // Changed areas since the last snapshot
+    bool _noteDirtyAll = true;
     
-    void resized() override{
-
-    }
+    // Work columns for the batch conversion in updateNoteLayer, kept to reuse the allocation.
+    struct NoteColumns{
+        std::vector<Duration> _gridPos, _pos, _duration;
+        std::vector<int> _note;
+        std::vector<float> _xGrid, _xAct, _y, _w;
+    } _noteWork;
     
-    void paint(Graphics& g) override{
+    void updateNoteLayer(){
         SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
         SequenceDrummer::Sequence& seq = sd.getSequence();
         bool lockOffGrid = _pm.getBoolParam(ParameterManager::LOCK_OFF_GRID_PARAM)->get();
-
+        
+        std::vector<double> geometry = {_conv->convToScreenX(0), _conv->convToScreenWidth(Durations::BEAT4), _conv->convToScreenY(0), _conv->convToScreenHeight(1)};
+        if(geometry != _noteGeometry || lockOffGrid != _noteLockOffGrid){
+            AffineTransform oldToNew;
+            if(_noteGeometry.size() == geometry.size() && _noteGeometry[1] != 0 && _noteGeometry[3] != 0){
+                float sx = (float)(geometry[1] / _noteGeometry[1]), sy = (float)(geometry[3] / _noteGeometry[3]);
+                oldToNew = AffineTransform::scale(sx, sy).translated((float)(geometry[0] - _noteGeometry[0] * sx), (float)(geometry[2] - _noteGeometry[2] * sy));
+            }
+            _noteGeometry = geometry;
+            _noteLockOffGrid = lockOffGrid;
+            _noteLayer.setGeometryKey(geometry, oldToNew);
+            _noteDirtyAll = true;
+        }
+        
+        // Margin beyond the tile size, so that every tile drawn in the visible area is covered by the snapshot.
+        int margin = jmax(getWidth(), 2 * AsyncTiledLayer::tileSize);
+        bool inRange = _noteRangeX0 <= _scrollX && _scrollX + getWidth() <= _noteRangeX1;
+        if(!_noteDirtyAll && _noteRevision == _noteSnapshotRevision && inRange) return;
+        _noteSnapshotRevision = _noteRevision;
+        if(!inRange || _noteDirtyAll){
+            _noteRangeX0 = _scrollX - margin;
+            _noteRangeX1 = _scrollX + getWidth() + margin;
+        }
+        
+        // Notes whose drawn area can reach the range. Found by the position index, hence the cost follows the notes around the view, not the pattern size.
+        // No read lock required in main thread process, as no write done outside main thread.
+        const SequenceDrummer::SeqStorage& storage = seq.getStorage();
+        Duration nudgeSpan = (InternalParam::maxNudge - InternalParam::minNudge) * Durations::TICK;
+        size_t first = storage.lowerBound((Duration)_conv->convFromScreenX(_noteRangeX0) - storage.maxDuration() - nudgeSpan);
+        size_t last = storage.upperBound((Duration)_conv->convFromScreenX(_noteRangeX1) + nudgeSpan);
+        size_t n = last > first ? last - first : 0;
+        
+        // Gather the columns, then convert them in one batch.
+        _noteWork._gridPos.resize(n);
+        _noteWork._pos.resize(n);
+        _noteWork._duration.resize(n);
+        _noteWork._note.resize(n);
+        for(size_t i = 0; i < n; ++i){
+            SequenceDrummer::SequenceEntry e = storage.entryAt(first + i);
+            _noteWork._gridPos[i] = e._pos - e._nudge;
+            _noteWork._pos[i] = e._pos;
+            _noteWork._duration[i] = e._duration;
+            _noteWork._note[i] = e._note;
+        }
+        _noteWork._xGrid.resize(n);
+        _noteWork._xAct.resize(n);
+        _noteWork._y.resize(n);
+        _noteWork._w.resize(n);
+        // intentinally use float as much as possible to smooth rendering.
+        _conv->convNotesToScreen(_noteWork._gridPos.data(), _noteWork._duration.data(), _noteWork._note.data(), n,
+                                 _noteWork._xGrid.data(), _noteWork._y.data(), _noteWork._w.data()); // y is the "upper" end of the rectangle for seq._note.
+        _conv->convToScreenX(_noteWork._pos.data(), n, _noteWork._xAct.data());
+        int h = -_conv->convToScreenHeight(1);
+        
+        std::shared_ptr<NoteSnapshot> snapshot = std::make_shared<NoteSnapshot>();
+        snapshot->_items.reserve(n);
+        for(size_t i = 0; i < n; ++i){
+            SequenceDrummer::SequenceEntry e = storage.entryAt(first + i);
+            NoteSnapshot::Item item;
+            item._xGrid = _noteWork._xGrid[i];
+            item._xAct = _noteWork._xAct[i];
+            item._w = _noteWork._w[i];
+            item._y = (int)_noteWork._y[i];
+            item._h = h;
+            item._nudged = e._nudge != 0;
+            item._bucket = e._vel & 0x7f;
+            if(lockOffGrid && !seq.isOnGrid(e, storage.gridMaskAt(first + i))){
+                item._bucket = NB_OFF_GRID;
+            }else if( sd.isSelected(storage.handleAt(first + i)) ){
+                item._bucket += NB_SELECTED;
+            }
+            snapshot->_maxExtent = jmax(snapshot->_maxExtent, std::abs(item._xAct - item._xGrid) + item._w);
+            snapshot->_items.push_back(item);
+        }
+        
+        // Only the tiles of the changed areas are re-rendered. A new range alone changes nothing in the tiles drawn so far.
+        std::shared_ptr<const AsyncTiledLayer::Renderer> renderer = std::make_shared<const AsyncTiledLayer::Renderer>([snapshot](Graphics& g){ snapshot->render(g); });
+        if(_noteDirtyAll) _noteLayer.setContent(renderer);
+        else _noteLayer.setContent(renderer, _noteDirty);
+        _noteDirty.clear();
+        _noteDirtyAll = false;
+    }
+    
+    /**
+     * Static layer : depends only on the zoom, the grid and the loop length (see the key in paint()).
+     * Only the rows and grid lines intersecting with the clip region are drawn.
+     */
+    void paintBackground(Graphics& g){
+        SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
+        SequenceDrummer::Sequence& seq = sd.getSequence();
+        
         g.fillAll (ColourParam::seqViewBG);   // clear the background
         
         static const int blackWhite[12] = {1,0,1,0,1,1,0,1,0,1,0,1}; // 0 : black, 1 : white
         
+        // Time window is widened by the thickest line (3px) at the both ends.
+        Rectangle<int> clip = g.getClipBounds();
+        Duration tFrom = jmax(Duration(0), (Duration)_conv->convFromScreenX(clip.getX() - 2));
+        Duration tTo   = jmin(seq.getLength(), (Duration)_conv->convFromScreenX(clip.getRight() + 2));
+        int rowLo = jmax(0,   (int)std::floor(_conv->convFromScreenY(clip.getBottom())));
+        int rowHi = jmin(127, (int)std::ceil(_conv->convFromScreenY(clip.getY())));
+        float xFrom = _conv->convToScreenX(tFrom);
+        float xTo = _conv->convToScreenX(tTo);
 
-        for(int i = 0; i < 128; ++i){
+        for(int i = rowLo; i <= rowHi; ++i){
             g.setColour(ColourParam::seqViewGridLine);
-            g.drawLine(_conv->convToScreenX(0), _conv->convToScreenY(i), _conv->convToScreenX(sd.getSequence().getLength()), _conv->convToScreenY(i));
+            g.drawLine(xFrom, _conv->convToScreenY(i), xTo, _conv->convToScreenY(i));
             
             if(blackWhite[i%12] == 1){
                 // only white key
                 g.setColour(ColourParam::seqViewWhiteKeyBG);
-                g.fillRect(_conv->convToScreenX(0), _conv->convToScreenY(i+1), _conv->convToScreenX(sd.getSequence().getLength()) - _conv->convToScreenX(0), -_conv->convToScreenHeight(1));
+                g.fillRect(xFrom, _conv->convToScreenY(i+1), xTo - xFrom, -_conv->convToScreenHeight(1));
             }
         }
         g.setColour(ColourParam::seqViewGridLine);
-        for(Duration p = 0; p <= seq.getLength(); p += seq._gridIntervalDuration){
-            
+        const std::vector<Duration>& lines = seq.getGridLines();
+        for(auto it = std::lower_bound(lines.begin(), lines.end(), tFrom); it != lines.end() && *it <= tTo; ++it){
+            Duration p = *it;
             if(p%Durations::BEAT4==0){
                 g.drawLine(_conv->convToScreenX(p), _conv->convToScreenY(0), _conv->convToScreenX(p), _conv->convToScreenY(128), 3);
             }else{
@@ -237,44 +493,128 @@ public:
             }
         }
         
-
-
-        // No read lock required in main thread process, as no write done outside main thread.
-        SequenceDrummer::SeqStorageCItr it;
-        for(it = seq.getStorage().begin(); it != seq.getStorage().end(); ++it){
-            if(it->second._pos >= seq.getLength()) break;
-            float x_grid = _conv->convToScreenX(it->second._pos - it->second._nudge); // intentinally use float as much as possible to smooth rendering.
-            float x_act  = _conv->convToScreenX(it->second._pos);
-            int y_p = _conv->convToScreenY(it->second._note+1); // This is the "upper" end of the rectangle for seq._note.
-            bool onGrid = (it->second._pos - it->second._nudge) % seq._gridIntervalDuration == 0;
-            colormap::COLOUR c = colormap::GetColour(it->second._vel, 0, 127);
-            if(lockOffGrid && (!onGrid)){
-                g.setColour(Colours::grey);
-            }else{
-                if( sd.isSelected(it) ){
-                    g.setColour(Colour::fromRGB(c.r*255, c.g*255, c.b*255).brighter(1.0).brighter(1.0));
-                }else{
-                    g.setColour(Colour::fromRGB(c.r*255, c.g*255, c.b*255));
-                }
+        // Lanes with their own grid : redraw the row with the lane grid.
+        for(int i = rowLo; i <= rowHi; ++i){
+            int laneDiv = seq.getLaneDivision(i);
+            if(laneDiv == 0) continue;
+            float y = _conv->convToScreenY(i+1);
+            float h = -_conv->convToScreenHeight(1);
+            g.setColour(blackWhite[i%12] == 1 ? ColourParam::seqViewWhiteKeyBG : ColourParam::seqViewBlackKeyBG);
+            g.fillRect(xFrom, y, xTo - xFrom, h);
+            g.setColour(ColourParam::laneGridLine);
+            Duration iv = GridTable::interval(laneDiv);
+            for(Duration p = (tFrom + iv - 1) / iv * iv; p <= tTo; p += iv){
+                g.drawLine(_conv->convToScreenX(p), y, _conv->convToScreenX(p), y + h, p%Durations::BEAT4==0 ? 3 : 1);
             }
-            
-            if(it->second._nudge == 0){
-                g.fillRect((int)x_grid, y_p, (int)_conv->convToScreenWidth(it->second._duration), (int)-_conv->convToScreenHeight(1));
+        }
+    }
+    
+public:
+    PianoRollView(ParameterManager& pm, Drummer& drummer, ViewConverter* conv) : _drummer(drummer), _pm(pm), _conv(conv),
+        _noteLayer([this](Rectangle<int> r){ repaintContent(r); }) {
+        setName("PianoRollContainerView");
+        setWantsKeyboardFocus(true);
+        
+        // GLOBAL_GRID_PARAM needs to be ready at this stage.
+        pm.addCallback(pm.GLOBAL_GRID_PARAM, [this](float v,bool){
+            SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(this->_drummer);
+            SequenceDrummer::Sequence& seq = sd.getSequence();
+            seq.setGridInterval(GridTable::interval(jlimit(GridTable::minDivision, GridTable::maxDivision, (int)v)));
+            sd.notifyChanges(); // Whole view is repainted by onSequenceChange
+        });
+        
+        SafePointer<PianoRollView> safeThis(this);
+        dynamic_cast<SequenceDrummer&>(drummer).addCallback([safeThis](const SequenceDrummer::ChangeSet& changes){
+            if(safeThis != nullptr) safeThis->onSequenceChange(changes);
+        });
+    }
+    
+    /**
+     * Invalidate only the union of the old and new extents of the changed notes, and the notes whose selection state is changed.
+     * Edits are notified through the change set rather than repainting the whole (pattern width) component.
+     */
+    void onSequenceChange(const SequenceDrummer::ChangeSet& changes){
+        typedef SequenceDrummer::ChangeSet ChangeSet;
+        ++_noteRevision;
+        if(changes.has(ChangeSet::LENGTH | ChangeSet::GRID | ChangeSet::RESET)){
+            _noteDirtyAll = true;
+            repaint();
+            return;
+        }
+        
+        // Beyond this, a single bounding box is cheaper than many small regions.
+        static const size_t maxDirtyRects = 64;
+        const SequenceDrummer::SeqStorage& storage = dynamic_cast<SequenceDrummer&>(_drummer).getSequence().getStorage();
+        bool merge = changes._notes._ops.size() + changes._selected.size() + changes._unselected.size() > maxDirtyRects;
+        Rectangle<int> bounds;
+        auto invalidate = [this, merge, &bounds](const SequenceDrummer::SequenceEntry& e){
+            Rectangle<int> r = getNoteExtent(e);
+            if(merge){
+                bounds = bounds.getUnion(r);
             }else{
-                Path path;
-                float w = _conv->convToScreenWidth(it->second._duration);
-                int h = -_conv->convToScreenHeight(1);
-                path.startNewSubPath(x_grid, y_p);
-                path.lineTo(x_act, y_p + h/2);
-                path.lineTo(x_grid, y_p + h);
-                path.lineTo(x_grid + w, y_p + h);
-                path.lineTo(x_act + w, y_p + h/2);
-                path.lineTo(x_grid + w, y_p);
-                path.closeSubPath();
-                
-                g.fillPath(path);
+                repaintContent(r);
+                _noteDirty.push_back(r);
+            }
+        };
+        for(const SeqDelta::Op& op : changes._notes._ops){
+            if(op._type != SeqDelta::INSERTED) invalidate(op._before);
+            if(op._type != SeqDelta::ERASED) invalidate(op._after);
+        }
+        for(const std::vector<SequenceDrummer::NoteHandle>* handles : {&changes._selected, &changes._unselected}){
+            for(SequenceDrummer::NoteHandle h : *handles){
+                if(storage.isValid(h)) invalidate(storage.get(h));
             }
         }
+        if(merge && !bounds.isEmpty()){
+            repaintContent(bounds);
+            _noteDirty.push_back(bounds);
+        }
+    }
+    
+    virtual ~PianoRollView(){
+        // TODO : Remove callback to pm
+    }
+    
+    void setScrollX(int x){
+        _scrollX = x;
+        repaint();
+    }
+    
+    void resized() override{
+
+    }
+    
+    void paint(Graphics& g) override{
+        SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
+        SequenceDrummer::Sequence& seq = sd.getSequence();
+        g.setOrigin(-_scrollX, 0);
+
+        // Background is re-rasterized only when any of these is changed.
+        _bgCache.setKey({_conv->convToScreenX(0), _conv->convToScreenWidth(Durations::BEAT4), _conv->convToScreenY(0), _conv->convToScreenHeight(1), (double)seq.getLength(), (double)seq.gridVersion()});
+        _bgCache.draw(g, [this](Graphics& bg){ paintBackground(bg); });
+        
+        // Only the overlays intersecting with the clip region are drawn, hence the cost follows what is on the screen, not the pattern size.
+        Rectangle<int> clip = g.getClipBounds();
+        Duration length = seq.getLength();
+        Duration tFrom = jmax(Duration(0), (Duration)_conv->convFromScreenX(clip.getX() - 2));
+        Duration tTo   = jmin(length, (Duration)_conv->convFromScreenX(clip.getRight() + 2));
+        int rowLo = jmax(0,   (int)std::floor(_conv->convFromScreenY(clip.getBottom())));
+        int rowHi = jmin(127, (int)std::ceil(_conv->convFromScreenY(clip.getY())));
+        float xFrom = _conv->convToScreenX(tFrom);
+        float xTo = _conv->convToScreenX(tTo);
+
+        // Notes are composited from the raster threads' tiles.
+        updateNoteLayer();
+        _noteLayer.draw(g);
+        
+        // Lane mute / solo state. Muted(or not soloed while any solo is active) lanes are dimmed.
+        for(int i = rowLo; i <= rowHi; ++i){
+            bool audible = sd.isLaneAudible(i);
+            bool soloed = sd.isLaneSoloed(i);
+            if(audible && !soloed) continue;
+            g.setColour(audible ? ColourParam::soloLaneMarker : ColourParam::mutedLaneOverlay);
+            g.fillRect(xFrom, _conv->convToScreenY(i+1), xTo - xFrom, -_conv->convToScreenHeight(1));
+        }
         
         if(_mm == MM_REGION_SELECT){
             g.setColour(Colours::white);
@@ -318,27 +658,37 @@ public:
     
     
     bool keyPressed(const KeyPress &k) override {
-        if( k.isKeyCode(KeyPress::deleteKey) || k.isKeyCode(KeyPress::backspaceKey) ){
+        if( k == KeyPress('z', ModifierKeys::commandModifier, 0) || k == KeyPress('z', ModifierKeys::commandModifier | ModifierKeys::shiftModifier, 0) ){
+            SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(this->_drummer);
+            
+            if(k.getModifiers().isShiftDown())
+                sd.redo();
+            else
+                sd.undo();
+            
+            return true;
+        }else if( k.isKeyCode(KeyPress::deleteKey) || k.isKeyCode(KeyPress::backspaceKey) ){
             SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(this->_drummer);
 
             sd.removeSelected();
-            repaint();
 
             return true;
         }else if(k.isKeyCode(KeyPress::leftKey) || k.isKeyCode(KeyPress::rightKey)){
             if(k.getModifiers().isAltDown()){
                 SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(this->_drummer);
                 Duration delta = (k.isKeyCode(KeyPress::leftKey) ? -1 : 1)*Durations::TICK;
+                SequenceDrummer::Sequence::Transaction tr = sd.getSequence().begin();
                 for(SequenceDrummer::SelectionItr sit = sd.getSelection().begin(); sit != sd.getSelection().end(); ++sit){
-                    Duration gridPos = sit->_selSeqItr->second._pos - sit->_selSeqItr->second._nudge;
-                    SequenceDrummer::SequenceEntry e = sit->_selSeqItr->second;
+                    SequenceDrummer::SequenceEntry e = sd.getEntry(*sit);
+                    Duration gridPos = e._pos - e._nudge;
                     e._nudge += delta;
                     e._nudge = jlimit(InternalParam::minNudge*Durations::TICK, InternalParam::maxNudge*Durations::TICK, e._nudge);
                     e._pos = gridPos + e._nudge;
-                    sd.moveSelectedNote(sit, e);
+                    sd.moveSelectedNote(tr, sit, e);
                 }
+                tr.commit();
                 sd.fixSelection();
-                repaint();
+                sd.notifyChanges();
                 return true;
             }
         }
@@ -372,20 +722,17 @@ public:
         if(_mm == MM_NONE){
             SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
             SequenceDrummer::Sequence& seq = sd.getSequence();
-            Point<int> pos = event.getPosition();
+            Point<int> pos = toContent(event);
             int note = (int)(_conv->convFromScreenY(pos.y));
-            bool spCursorSet = false;
-            for(SequenceDrummer::SeqStorageCItr it = seq.getStorage().begin(); it != seq.getStorage().end(); ++it)
-            {
-                if(it->second._note != note) continue;
-                Rectangle<int> bb = getNoteBBox(it->second);
-                if( abs(pos.x - bb.getRight()) <= 2 ){
-                    this->setMouseCursor(MouseCursor(MouseCursor::StandardCursorType::LeftRightResizeCursor));
-                    spCursorSet = true;
-                    break;
-                }
-            }
-            if(!spCursorSet)
+            const SequenceDrummer::SeqStorage& storage = seq.getStorage();
+            // Only the notes of the row reaching the pointer are tested, through the pitch index.
+            bool spCursorSet = note >= 0 && note < 128 &&
+                storage.forEachInSpan(note, _conv->convFromScreenX(pos.x - 3), _conv->convFromScreenX(pos.x + 3), [this, &storage, pos](SequenceDrummer::NoteHandle h){
+                    return abs(pos.x - getNoteBBox(storage.get(h)).getRight()) <= 2;
+                });
+            if(spCursorSet)
+                this->setMouseCursor(MouseCursor(MouseCursor::StandardCursorType::LeftRightResizeCursor));
+            else
                 this->setMouseCursor(MouseCursor(MouseCursor::StandardCursorType::ParentCursor));
         }else if(_mm == MM_DURATION_DRAG_TAIL){
             // N/A
@@ -397,7 +744,7 @@ public:
     }
     
     void mouseDown(const MouseEvent &event) override{
-        Point<int> pos = event.getPosition();
+        Point<int> pos = toContent(event);
         //Rectangle<int> ref = getRefArea();
         Duration x = _conv->convFromScreenX(pos.x);
         int note = (int)(_conv->convFromScreenY(pos.y));
@@ -406,6 +753,11 @@ public:
         
         _selStart = pos;
         _mm = MM_NONE; // default. In this mode, nothing proessed while dragging.
+        
+        if(event.mods.isPopupMenu()){
+            showTransformMenu();
+            return;
+        }
                 
         // Selection policy
         // Common rule : Offgrid note is not selected when lockOffGrid is ON (common and independent rule)
@@ -422,74 +774,168 @@ public:
         //    else
         //        add the selected note if selected.
         //    common : Disable dragging process untill next mouse down
-        auto it = std::find_if(seq.getStorage().begin(), seq.getStorage().end(), [x, note](const SequenceDrummer::SeqStoragePair& p){ return p.second._note==note && ( (p.second._pos-p.second._nudge) <= x) && ( x <= (p.second._pos-p.second._nudge) + p.second._duration); });
+        const SequenceDrummer::SeqStorage& storage = seq.getStorage();
+        SequenceDrummer::NoteHandle hit;
+        if(note >= 0 && note < 128){
+            storage.forEachInSpan(note, x, x, [&hit](SequenceDrummer::NoteHandle h){ hit = h; return true; });
+        }
 
         if(event.mods.isCommandDown()){
             // Addition of new note
-            int gridId = ::round(x / seq._gridIntervalDuration); // TODO more intuitive
-            int nGrid = static_cast<int>(seq.getLength() / seq._gridIntervalDuration); // Limit : this hould be integer
-            //_selGridId = ::floor(x * _pattern._nGrid);
-            if(gridId >=0 && gridId < nGrid){
-                Duration gridPos = seq._gridIntervalDuration * gridId; // equals actual pos with nudge = 0
+            Duration gridPos = seq.snapToGrid(x, note); // equals actual pos with nudge = 0
+            if(gridPos >= 0 && gridPos < seq.getLength()){
                 SequenceDrummer::SequenceEntry newEntry;
                 newEntry._note = note;
                 newEntry._pos = gridPos;
                 newEntry._nudge = 0;
                 newEntry._vel = _pm.getFloat(ParameterManager::VELOCITY_PARAM);
                 newEntry._duration = Durations::BEAT32;
-                auto selSeqItr = seq.insert(SequenceDrummer::SeqStoragePair(newEntry._pos,newEntry));
+                SequenceDrummer::Sequence::Transaction tr = seq.begin();
+                tr.insert(newEntry);
+                SequenceDrummer::NoteHandle newHandle = tr.commit().front();
                 
                 sd.clearSelection();
-                sd.addSelection(selSeqItr);
+                sd.addSelection(newHandle);
             }
         }else if(!event.mods.isShiftDown()){
             // Witout shift key
-            if(it == seq.getStorage().end()){
+            if(hit.isNull()){
                 // no selection
                 sd.clearSelection();
                 _mm = MM_REGION_SELECT; // Region select mode
-            }else if( sd.isSelected(it) ){
+            }else if( sd.isSelected(hit) ){
                 // already selected
-                _mm = abs(getNoteBBox(it->second).getRight() - pos.x) <= 2 ? MM_DURATION_DRAG_TAIL : MM_POSITION_DRAG;
+                _mm = abs(getNoteBBox(storage.get(hit)).getRight() - pos.x) <= 2 ? MM_DURATION_DRAG_TAIL : MM_POSITION_DRAG;
             }else{
                 // other note selected
                 sd.clearSelection();
-                sd.addSelection(it);
-                _mm = abs(getNoteBBox(it->second).getRight() - pos.x) <= 2 ? MM_DURATION_DRAG_TAIL : MM_POSITION_DRAG;
+                sd.addSelection(hit);
+                _mm = abs(getNoteBBox(storage.get(hit)).getRight() - pos.x) <= 2 ? MM_DURATION_DRAG_TAIL : MM_POSITION_DRAG;
 
             }
         }else{
             // With shift key
-            if(it == seq.getStorage().end()){
+            if(hit.isNull()){
                 // Not selected
                 // Do nothing
                 _mm = MM_REGION_SELECT; // And also addition mode
-            }else if( sd.isSelected(it)){
+            }else if( sd.isSelected(hit)){
                 // Already selected note
-                sd.deleteSelection(it);
+                sd.deleteSelection(hit);
             }else{
                 // New selection
-                sd.addSelection(it);
+                sd.addSelection(hit);
             }
         }
         
         bool lockOffGrid = _pm.getBoolParam(ParameterManager::LOCK_OFF_GRID_PARAM)->get();
         if(lockOffGrid){
             // Delete selection for the off grid notes if any
-            Duration gridIntervalDuration = seq._gridIntervalDuration;
-            sd.unSelectIf([gridIntervalDuration](const SequenceDrummer::SequenceEntry& e){ return (e._pos - e._nudge) % gridIntervalDuration != 0; });
+            sd.unSelectMatching(SequenceDrummer::NoteQuery().offGrid());
         }
         
         if(_mm == MM_REGION_SELECT){
             // Remeber the current selection set
             _selsOnStart = sd.getSelection();
+            _regionHits.clear();
         }else if(_mm == MM_POSITION_DRAG){
             sd.stash();
-            sd.duplicateSelection();
-            sd.labelCurrentAs(false);
         }
         
-        repaint();
+        // Whole drag until mouseUp is a single undo step. Only for the drags, so that a click which never gets mouseUp (e.g. popup) cannot leave the group open.
+        if(_mm == MM_POSITION_DRAG || _mm == MM_DURATION_DRAG_TAIL || _mm == MM_DURATION_DRAG_HEAD){
+            seq.beginUndoGroup();
+            _inUndoGroup = true;
+        }
+    }
+    
+    /**
+     * Pattern transforms for the selected notes, or the whole pattern if nothing is selected.
+     */
+    void showTransformMenu(){
+        enum{
+            TR_ROTATE_LEFT = 1, TR_ROTATE_RIGHT, TR_REVERSE, TR_DUPLICATE_LOOP,
+            TR_VEL_SCALE_DOWN, TR_VEL_SCALE_UP, TR_VEL_COMPRESS, TR_VEL_RANDOMIZE,
+            TR_QUANTIZE_HALF, TR_QUANTIZE_FULL,
+            TR_TIME_SCALE = 100 // + index of timeScales
+        };
+        static const std::pair<int,int> timeScales[] = { {4,3}, {4,5}, {4,6}, {4,7}, {3,4}, {5,4}, {6,4}, {7,4} };
+        
+        PopupMenu m;
+        m.addItem(TR_ROTATE_LEFT, "Rotate Left");
+        m.addItem(TR_ROTATE_RIGHT, "Rotate Right");
+        m.addItem(TR_REVERSE, "Reverse");
+        m.addItem(TR_DUPLICATE_LOOP, "Duplicate Loop");
+        PopupMenu ts;
+        for(int i = 0; i < (int)(sizeof(timeScales)/sizeof(timeScales[0])); ++i){
+            ts.addItem(TR_TIME_SCALE + i, String("1/") + String(timeScales[i].first) + " -> 1/" + String(timeScales[i].second));
+        }
+        m.addSubMenu("Time Scale", ts);
+        m.addSeparator();
+        m.addItem(TR_VEL_SCALE_DOWN, "Velocity x 0.8");
+        m.addItem(TR_VEL_SCALE_UP, "Velocity x 1.2");
+        m.addItem(TR_VEL_COMPRESS, "Velocity Compress");
+        m.addItem(TR_VEL_RANDOMIZE, "Velocity Randomize");
+        m.addSeparator();
+        m.addItem(TR_QUANTIZE_HALF, "Quantize 50%");
+        m.addItem(TR_QUANTIZE_FULL, "Quantize 100%");
+        
+        SafePointer<PianoRollView> safeThis(this);
+        m.showMenuAsync(PopupMenu::Options(), [safeThis](int result){
+            if(safeThis == nullptr || result == 0) return;
+            SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(safeThis->_drummer);
+            Duration grid = sd.getSequence()._gridIntervalDuration;
+            
+            if(result == TR_DUPLICATE_LOOP){
+                PatternTransform::duplicateLoop(sd); // Relayout follows ChangeSet::LENGTH (see MainView::onSequenceChange)
+            }else{
+                PatternTransform tr(sd);
+                if(result == TR_ROTATE_LEFT) tr.rotate(-grid);
+                else if(result == TR_ROTATE_RIGHT) tr.rotate(grid);
+                else if(result == TR_REVERSE) tr.reverse();
+                else if(result == TR_VEL_SCALE_DOWN) tr.scaleVelocity(0.8f);
+                else if(result == TR_VEL_SCALE_UP) tr.scaleVelocity(1.2f);
+                else if(result == TR_VEL_COMPRESS) tr.compressVelocity(0.5f);
+                else if(result == TR_VEL_RANDOMIZE) tr.randomizeVelocity(10);
+                else if(result == TR_QUANTIZE_HALF) tr.quantize(0.5f);
+                else if(result == TR_QUANTIZE_FULL) tr.quantize(1.0f);
+                else if(result >= TR_TIME_SCALE) tr.timeScale(timeScales[result - TR_TIME_SCALE].first, timeScales[result - TR_TIME_SCALE].second);
+                tr.commit();
+            }
+        });
+    }
+    
+    // Drawn area of the note : between the grid and the actual position (nudge) plus duration, with 2px margin for the rounding.
+    Rectangle<int> getNoteExtent(const SequenceDrummer::SequenceEntry& s){
+        float x0 = _conv->convToScreenX(jmin(s._pos - s._nudge, s._pos));
+        float x1 = _conv->convToScreenX(jmax(s._pos - s._nudge, s._pos)) + _conv->convToScreenWidth(s._duration);
+        float y = _conv->convToScreenY(s._note+1);
+        return Rectangle<float>(x0, y, x1 - x0, -_conv->convToScreenHeight(1)).getSmallestIntegerContainer().expanded(2);
+    }
+    
+    // Border of the selection rectangle
+    void repaintOutline(const Rectangle<int>& r){
+        repaintContent({r.getX() - 1, r.getY() - 1, r.getWidth() + 2, 3});
+        repaintContent({r.getX() - 1, r.getBottom() - 2, r.getWidth() + 2, 3});
+        repaintContent({r.getX() - 1, r.getY() - 1, 3, r.getHeight() + 2});
+        repaintContent({r.getRight() - 2, r.getY() - 1, 3, r.getHeight() + 2});
+    }
+    
+    // Notes whose bounding box intersects with r, sorted by the slot index. Candidates are taken from the pitch index for the rows and the time span of r.
+    void collectNotesIn(const Rectangle<int>& r, std::vector<SequenceDrummer::NoteHandle>& out){
+        const SequenceDrummer::SeqStorage& storage = dynamic_cast<SequenceDrummer&>(_drummer).getSequence().getStorage();
+        out.clear();
+        int rowLo = jmax(0,   (int)std::floor(_conv->convFromScreenY(r.getBottom())) - 1);
+        int rowHi = jmin(127, (int)std::ceil(_conv->convFromScreenY(r.getY())));
+        Duration from = _conv->convFromScreenX(r.getX() - 2);
+        Duration to = _conv->convFromScreenX(r.getRight() + 2);
+        for(int note = rowLo; note <= rowHi; ++note){
+            storage.forEachInSpan(note, from, to, [this, &storage, &r, &out](SequenceDrummer::NoteHandle h){
+                if(r.intersects(getNoteBBox(storage.get(h)))) out.push_back(h);
+                return false;
+            });
+        }
+        std::sort(out.begin(), out.end(), [](SequenceDrummer::NoteHandle l, SequenceDrummer::NoteHandle r){ return l._index < r._index; });
     }
     
     Rectangle<int> getNoteBBox(const SequenceDrummer::SequenceEntry& s){
@@ -503,9 +949,9 @@ public:
     void mouseDrag(const MouseEvent &event) override{
         if(_mm == MM_REGION_SELECT){
             SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
-            SequenceDrummer::Sequence& seq = sd.getSequence();
             // Region selection mode
-            Point<int> pos = event.getPosition();
+            Point<int> pos = toContent(event);
+            repaintOutline(_selRegion);
             _selRegion.setX( jmin(pos.x, _selStart.x));
             _selRegion.setY( jmin(pos.y, _selStart.y));
             _selRegion.setWidth( abs(pos.x - _selStart.x) );
@@ -515,32 +961,30 @@ public:
             // If the note within the  selecition region and
             //   - If such note is already selected in initial selection set, unselect it
             //   - Otherwise select it.
-            SequenceDrummer::Selections _newSel = _selsOnStart;
-            for(SequenceDrummer::SeqStorageCItr it = seq.getStorage().begin(); it != seq.getStorage().end(); ++it)
-            {
-                if(_selRegion.intersects(getNoteBBox(it->second))){
-                    if(SequenceDrummer::FindSelection(_newSel, it)){
-                        _newSel.remove_if([it](const SequenceDrummer::Selection& s){ return s._selSeqItr == it; });
-                    }else{
-                        _newSel.push_back({it,it->second});
-                    }
-                }
-            }
+            // Only the notes entering or leaving the region are changed.
+            collectNotesIn(_selRegion, _regionWork);
+            auto byIndex = [](SequenceDrummer::NoteHandle l, SequenceDrummer::NoteHandle r){ return l._index < r._index; };
+            std::vector<SequenceDrummer::NoteHandle> entered, left;
+            std::set_difference(_regionWork.begin(), _regionWork.end(), _regionHits.begin(), _regionHits.end(), std::back_inserter(entered), byIndex);
+            std::set_difference(_regionHits.begin(), _regionHits.end(), _regionWork.begin(), _regionWork.end(), std::back_inserter(left), byIndex);
+            _regionHits.swap(_regionWork);
             
-            sd.setSelection(_newSel);
-            
-            repaint();
+            std::vector<std::pair<SequenceDrummer::NoteHandle, bool>> states;
+            for(SequenceDrummer::NoteHandle h : entered) states.push_back({h, !_selsOnStart.contains(h)});
+            for(SequenceDrummer::NoteHandle h : left) states.push_back({h, _selsOnStart.contains(h)});
+            if(!states.empty()) sd.setSelected(states);
+            repaintOutline(_selRegion);
         }else if(_mm == MM_DURATION_DRAG_TAIL){
             // Actually, cursor config is not needed as when the this mode is triggered, cursor is already horizontal resize cursor.
             this->setMouseCursor(MouseCursor(MouseCursor::StandardCursorType::LeftRightResizeCursor));
             
             SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
             // Region selection mode
-            Point<int> pos = event.getPosition();
+            Point<int> pos = toContent(event);
             int deltaScreenX = pos.x - _selStart.x; // either positive or negative
             Duration deltaDuration = _conv->convFromScreenWidth(deltaScreenX);
             if( sd.changeDurationSelected(deltaDuration) ){
-                repaint();
+                sd.notifyChanges();
             }
         }else if(_mm == MM_POSITION_DRAG){
             if(event.mods.isAltDown())
@@ -552,10 +996,9 @@ public:
             float deltaX = _conv->convFromScreenWidth(event.getDistanceFromDragStartX());
             int deltaNote = _conv->convFromScreenHeight(event.getDistanceFromDragStartY());
             SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
-            sd.selectFrontBack( !event.mods.isAltDown() );
-            if( sd.dragSelected(deltaX, deltaNote) ){
-                repaint();
-            }
+            sd.dragFrontBack( !event.mods.isAltDown(), deltaX, deltaNote );
+            sd.notifyChanges(); // Incl. the switch of front / back
+
         }
     }
 
@@ -565,10 +1008,15 @@ public:
             sd.selectFrontBack( !event.mods.isAltDown() );
         }
         sd.fixSelection();
+        if(_inUndoGroup){
+            sd.getSequence().endUndoGroup();
+            _inUndoGroup = false;
+        }
+        sd.notifyChanges();
         if(_mm == MM_REGION_SELECT){
             // To delete the selection rectangle, repaint after setting _mm to MM_NONE
             _mm = MM_NONE;
-            repaint();
+            repaintOutline(_selRegion);
         }else{
             _mm = MM_NONE;
         }
@@ -601,17 +1049,25 @@ public:
         SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
         SequenceDrummer::Sequence& seq = sd.getSequence();
         
+        // Only the scroll range follows the content width. Components stay at the viewport size.
         Rectangle<int> contentSize = getContentSize();
-        getScolloingContainer()->setBounds( applySizeIfBigger(contentSize, getLocalBounds()) );
-        _pr->setBounds( applySizeIfBigger(contentSize, getLocalBounds()) );
+        getScolloingContainer()->setBounds(getLocalBounds());
+        _pr->setBounds(getLocalBounds());
         
-        _hScrollBar.setRangeLimits(0.0, getScolloingContainer()->getWidth());
+        _hScrollBar.setRangeLimits(0.0, jmax(contentSize.getWidth(), getWidth()));
         _hScrollBar.setCurrentRange(_hScrollBar.getCurrentRangeStart(), getWidth());
 
-        _li->setTopLeftPosition(_conv->convToScreenX(seq.getLength()),0);
+        _li->setTopLeftPosition(_conv->convToScreenX(seq.getLength()) - getScrollX(), 0);
         _li->setSize(InternalParam::loopEndIndWidth, getHeight());
         
-        _ti->setSize(1,getHeight());
+        _ti->setBounds(getLocalBounds());
+    }
+    
+    virtual void scrolled() override {
+        SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
+        _pr->setScrollX(getScrollX());
+        _ti->setScrollX(getScrollX());
+        _li->setTopLeftPosition(_conv->convToScreenX(sd.getSequence().getLength()) - getScrollX(), 0);
     }
     
     Rectangle<int> getContentSize(){
@@ -659,10 +1115,34 @@ public:
     {
         bool lockOffGrid = _pm.getBoolParam(ParameterManager::LOCK_OFF_GRID_PARAM)->get();
         SequenceDrummer& sd = dynamic_cast<SequenceDrummer&>(_drummer);
-        Duration gridIntervalDuration = sd.getSequence()._gridIntervalDuration;
+        SequenceDrummer::Sequence& seq = sd.getSequence();
+        ModifierKeys mods = ModifierKeys::getCurrentModifiers();
+        
+        // Shift + click : assign the current grid division to the lane, or back to the common grid if already assigned.
+        if(mods.isShiftDown()){
+            int div = seq.gridDivision();
+            seq.setLaneDivision(midiNoteNumber, seq.getLaneDivision(midiNoteNumber) == div ? 0 : div);
+            sd.notifyChanges();
+            Component* pianoRoll = getParentComponent()->findChildWithID("PianoRollContainerView");
+            if(pianoRoll) pianoRoll->repaint();
+            return;
+        }
+        
+        // Alt + click : toggle lane mute, Cmd(Ctrl) + click : toggle lane solo.
+        // Only the lane mask is changed, hence no need to touch the sequence and selection.
+        if(mods.isAltDown() || mods.isCommandDown()){
+            if(mods.isAltDown()) sd.setLaneMute(midiNoteNumber, !sd.isLaneMuted(midiNoteNumber));
+            else                 sd.setLaneSolo(midiNoteNumber, !sd.isLaneSoloed(midiNoteNumber));
+            Component* pianoRoll = getParentComponent()->findChildWithID("PianoRollContainerView");
+            if(pianoRoll) pianoRoll->repaint();
+            return;
+        }
         
         sd.clearSelection();
-        sd.selectIf([midiNoteNumber, lockOffGrid, gridIntervalDuration](const SequenceDrummer::SequenceEntry& e){ return e._note == midiNoteNumber && (lockOffGrid ? (e._pos - e._nudge) % gridIntervalDuration == 0 : true); });
+        SequenceDrummer::NoteQuery q;
+        q.pitch(midiNoteNumber);
+        if(lockOffGrid) q.onGrid();
+        sd.selectMatching(q);
         Component* pianoRoll = getParentComponent()->findChildWithID("PianoRollContainerView");
         if(pianoRoll){
             pianoRoll->repaint();
@@ -729,13 +1209,27 @@ class UpperBar : public Component
     std::unique_ptr<SliderBridge> _hzoomSliderBridge;
     std::unique_ptr<IButtonBridge> _playBtnBridge;
     std::unique_ptr<IButtonBridge> _recBtnBridge;
+    std::unique_ptr<IButtonBridge> _lookaheadBtnBridge;
     SafePointer<PlayControl> _playCont;
     ViewZoomSlider _viewZoomSlierLF;
     ParamController _paramControllerLF;
 
     ParameterManager& _pm;
+    
+    // A knob gesture is a single undo step. Tracked per knob, as the host may not send begin / end in pairs.
+    bool _velocityInGesture;
+    bool _nudgeInGesture;
+    bool _inKnobEdit; // While notifying the edit made by the knob
+    void setKnobGesture(bool& inGesture, bool isStarting){
+        if(isStarting == inGesture) return;
+        inGesture = isStarting;
+        if(isStarting)
+            _sd.getSequence().beginUndoGroup();
+        else
+            _sd.getSequence().endUndoGroup();
+    }
 public:
-    UpperBar(ParameterManager& pm, SequenceDrummer& drummer) : _sd(drummer), _pm(pm){
+    UpperBar(ParameterManager& pm, SequenceDrummer& drummer) : _sd(drummer), _pm(pm), _velocityInGesture(false), _nudgeInGesture(false), _inKnobEdit(false){
         setName("UpperBar");
         _dndArea.reset(new HBox(new PatternDnDComponent(drummer),{1,1},HBox::LEFT,ColourParam::upViewBoundColour));
 
@@ -750,8 +1244,8 @@ public:
                 RotarySliderTypeA* velocityNob = new RotarySliderTypeA("Velocity");
                 _leftBox->addItem(velocityNob);
                 _velocityChangerBridge.reset(new SliderBridge(p, velocityNob->getSlider()));
-                _sd.addCallback(std::bind(&UpperBar::onSelectionChange, this));
-                pm.addCallback(pm.VELOCITY_PARAM, std::bind(&UpperBar::onVelocityChanged,this,std::placeholders::_1), std::bind(&UpperBar::onVelocityGestureChanged,this,std::placeholders::_1));
+                _sd.addCallback(std::bind(&UpperBar::onSelectionChange, this, std::placeholders::_1));
+                pm.addCallback(pm.VELOCITY_PARAM, std::bind(&UpperBar::onVelocityChanged,this,std::placeholders::_1, std::placeholders::_2), std::bind(&UpperBar::onVelocityGestureChanged,this,std::placeholders::_1));
             }
             {
                 AudioParameterFloat* p = pm.getFloatParam(ParameterManager::NUDGE_PARAM);
@@ -760,6 +1254,13 @@ public:
                 _nudgeChangerBridge.reset(new SliderBridge(p, nudgeNob->getSlider()));
                 pm.addCallback(pm.NUDGE_PARAM, std::bind(&UpperBar::onNudgeChanged,this,std::placeholders::_1, std::placeholders::_2), std::bind(&UpperBar::onNudgeGestureChanged,this,std::placeholders::_1));
             }
+            {
+                // Lookahead mode to play the negative nudge ahead of the host playhead. Latency is reported by the processor.
+                AudioParameterBool* p = pm.getBoolParam(ParameterManager::LOOKAHEAD_PARAM);
+                ToggleButtonBridge* bridge = new ToggleButtonBridge(p, "Pre-roll", [](bool v){ LOG("LOOKAHEAD", (int)v); });
+                _lookaheadBtnBridge.reset(bridge);
+                _leftBox->addItem(new HBox(bridge->getButton(),{20,0}));
+            }
         }
         
         // Center
@@ -835,13 +1336,25 @@ public:
     }
     virtual ~UpperBar(){
         LOG("UpperBar destructed");
+        setKnobGesture(_velocityInGesture, false);
+        setKnobGesture(_nudgeInGesture, false);
         
         removeAllChildren();
     }
     
-    void onSelectionChange(){
+    // Edits by the knobs are notified for the views, but the knobs themselves shall not follow them (snap shots are not fixed yet).
+    void notifyKnobEdit(){
+        _inKnobEdit = true;
+        _sd.notifyChanges();
+        _inKnobEdit = false;
+    }
+    
+    // Knobs follow the snap shots of the selection, which change only by selection or note changes.
+    void onSelectionChange(const SequenceDrummer::ChangeSet& changes){
+        if(_inKnobEdit) return;
+        if(!changes.has(SequenceDrummer::ChangeSet::SELECTION | SequenceDrummer::ChangeSet::NOTES | SequenceDrummer::ChangeSet::RESET)) return;
         {
-            int minVel = std::accumulate(_sd.getSelection().begin(), _sd.getSelection().end(), 128, [](int acc, const SequenceDrummer::Selection& s) { return (int)( acc < s._selSeqItr->second._vel ? acc :   s._selSeqItr->second._vel); });
+            int minVel = _sd.getSelection().minVelocity();
             if(minVel < 128){
                 // No selection will result in 128
                 _pm.setNotifyingHost(_pm.VELOCITY_PARAM, minVel);
@@ -849,28 +1362,32 @@ public:
             }
         }
         {
-            double sumNudge = std::accumulate(_sd.getSelection().begin(), _sd.getSelection().end(), 0, [](double acc, const SequenceDrummer::Selection& s) { return (double)( acc + s._mouseDownSnapShot._nudge); });
             if(_sd.getSelection().size() > 0){
-                double avgNudge = sumNudge / _sd.getSelection().size();
+                double avgNudge = _sd.getSelection().averageNudge();
                 _pm.setNotifyingHost(_pm.NUDGE_PARAM, round(avgNudge/Durations::TICK));
                 LOG("Selectiong update", avgNudge);
             }
         }
     }
     
-    void onVelocityChanged(float v){
-        int orgMinVel = std::accumulate(_sd.getSelection().begin(), _sd.getSelection().end(), 128, [](int acc, const SequenceDrummer::Selection& s) { return (int)( acc < s._mouseDownSnapShot._vel ? acc : s._mouseDownSnapShot._vel); });
+    void onVelocityChanged(float v, bool isInUserGesture){
+        if(!isInUserGesture) return; // e.g. set by onSelectionChange
+        
+        int orgMinVel = _sd.getSelection().minVelocity();
         if(orgMinVel < 128){
             int delta = v - orgMinVel;
+            SequenceDrummer::Sequence::Transaction tr = _sd.getSequence().begin();
             for(SequenceDrummer::SelectionItr sit = _sd.getSelection().begin(); sit != _sd.getSelection().end(); ++sit){
-                _sd.getSequence().updateVelocity(sit->_selSeqItr, jmin(jmax(0, sit->_mouseDownSnapShot._vel + delta),127));
+                tr.updateVelocity(sit->_handle, jmin(jmax(0, sit->_mouseDownSnapShot._vel + delta),127));
             }
-            getParentComponent()->repaint();
+            tr.commit();
+            notifyKnobEdit();
         }
     }
     
     void onVelocityGestureChanged(bool isStarting){
         _sd.fixSelection();
+        setKnobGesture(_velocityInGesture, isStarting);
     }
     
     void onNudgeChanged(float v, bool isInUserGesture){
@@ -878,8 +1395,8 @@ public:
         if(!isInUserGesture) return;
         
         Duration dv = v * Durations::TICK;
-        double sumNudge = std::accumulate(_sd.getSelection().begin(), _sd.getSelection().end(), 0, [](double acc, const SequenceDrummer::Selection& s) { return (double)( acc + s._mouseDownSnapShot._nudge); });
-        double avgNudge = sumNudge / _sd.getSelection().size();
+        double avgNudge = _sd.getSelection().averageNudge();
+        SequenceDrummer::Sequence::Transaction tr = _sd.getSequence().begin();
         for(SequenceDrummer::SelectionItr sit = _sd.getSelection().begin(); sit != _sd.getSelection().end(); ++sit){
             Duration delta = (Duration)(dv - avgNudge);
             Duration gridPos = sit->_mouseDownSnapShot._pos - sit->_mouseDownSnapShot._nudge;
@@ -887,13 +1404,15 @@ public:
             e._nudge += delta;
             e._nudge = jlimit(InternalParam::minNudge*Durations::TICK, InternalParam::maxNudge*Durations::TICK, e._nudge);
             e._pos = gridPos + e._nudge;
-            _sd.moveSelectedNote(sit, e);
+            _sd.moveSelectedNote(tr, sit, e);
         }
-        getParentComponent()->repaint();
+        tr.commit();
+        notifyKnobEdit();
     }
     
     void onNudgeGestureChanged(bool isStarting){
         _sd.fixSelection();
+        setKnobGesture(_nudgeInGesture, isStarting);
     }
     
     void paint (Graphics& g) override {
@@ -910,9 +1429,9 @@ public:
         {
             Rectangle<int> bb = lb;
             bb.setX(0);
-            bb.setWidth(150);
+            bb.setWidth(225);
             _leftBox->setBounds(bb);
-            left_end += 150;
+            left_end += 225;
         }
 
         // Right
@@ -1073,9 +1592,15 @@ public:
             addAndMakeVisible(_vScrollBar);
             addAndMakeVisible(_hScrollBar);
 
+            // Scroll range, loop end indicator and the ruler width follow the length, including undo / redo of it.
+            SafePointer<MainView> safeThis(this);
+            dynamic_cast<SequenceDrummer&>(drummer).addCallback([safeThis](const SequenceDrummer::ChangeSet& changes){
+                if(safeThis != nullptr) safeThis->onSequenceChange(changes);
+            });
         }
         
         MessageChannel::getInstance().addCallback(MessageChannel::ON_LOOP_END_CHANGE, std::bind(&MainView::onLoopEndChange, this));
+        MessageChannel::getInstance().addCallback(MessageChannel::ON_GRID_MAP_CHANGE, std::bind(&MainView::onGridMapChange, this));
         pm.addCallback(pm.VZOOM_PARAM, std::bind(&MainView::onVzoomSliderChanged, this, std::placeholders::_1));
         pm.addCallback(pm.HZOOM_PARAM, std::bind(&MainView::onHzoomSliderChanged, this, std::placeholders::_1));
 
@@ -1083,6 +1608,7 @@ public:
     
     void setReferenceRegion(float vzoom, float hzoom){
         _refRegionForConv = Rectangle<int>(InternalParam::_hoffset, 0, InternalParam::_widthForBEAT4 * hzoom, InternalParam::pianoRollRowHeight*128 * vzoom);
+        if(_conv != nullptr) _conv->refRectChanged();
     }
     virtual ~MainView(){
         removeAllChildren();
@@ -1113,6 +1639,16 @@ public:
         _timeRuler->repaint();
     }
     
+    void onGridMapChange(){
+        _containerView->repaint();
+    }
+    
+    void onSequenceChange(const SequenceDrummer::ChangeSet& changes){
+        if(!changes.has(SequenceDrummer::ChangeSet::LENGTH | SequenceDrummer::ChangeSet::RESET)) return;
+        resized();
+        _timeRuler->repaint();
+    }
+    
     void resized () override {
         Rectangle<int> lb = getLocalBounds();
         Rectangle<int> timeRulerSize = _timeRuler->getContentSize();
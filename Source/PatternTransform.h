@@ -0,0 +1,196 @@
+/*
+  ==============================================================================
+
+    PatternTransform.h
+    Created: 19 Oct 2026 3:40:12pm
+    Author:  Hiroyuki Baba
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Common.h"
+#include "Helper.h"
+#include "Drummer.h"
+#include <numeric>
+#include <algorithm>
+
+/**
+ * One-shot transforms of the selected notes (or the whole pattern if nothing is selected).
+ * Target notes are gathered into the columns once, each operation is a plain loop over the columns,
+ * and commit() writes them back as a single transaction, i.e. one sorted merge, one publish to the audio thread and one undo step.
+ * Operations can be chained before commit().
+ */
+class PatternTransform
+{
+    SequenceDrummer& _sd;
+
+    // Columns of the target notes. Positions are kept as grid position (_pos - _nudge) and nudge.
+    std::vector<SequenceDrummer::NoteHandle> _handle;
+    std::vector<int> _note;
+    std::vector<Duration> _gridPos;
+    std::vector<Duration> _nudge;
+    std::vector<Duration> _duration;
+    std::vector<int> _vel;
+    Duration _length; // Loop length after the transform. Committed in the same undo step as the notes.
+
+    void gather(SequenceDrummer::NoteHandle h, const SequenceDrummer::SequenceEntry& e){
+        _handle.push_back(h);
+        _note.push_back(e._note);
+        _gridPos.push_back(e._pos - e._nudge);
+        _nudge.push_back(e._nudge);
+        _duration.push_back(e._duration);
+        _vel.push_back(e._vel);
+    }
+
+public:
+    PatternTransform(SequenceDrummer& sd) : _sd(sd), _length(sd.getSequence().getLength()) {
+        if(sd.getSelection().size() > 0){
+            for(const SequenceDrummer::Selection& s : sd.getSelection()){
+                gather(s._handle, sd.getEntry(s));
+            }
+        }else{
+            const SequenceDrummer::SeqStorage& storage = sd.getSequence().getStorage();
+            for(size_t i = 0; i < storage.size(); ++i){
+                gather(storage.handleAt(i), storage.entryAt(i));
+            }
+        }
+    }
+
+    size_t size() const { return _handle.size(); }
+
+    // Shift in time, wrapping around the loop.
+    PatternTransform& rotate(Duration by){
+        for(size_t i = 0; i < _gridPos.size(); ++i){
+            _gridPos[i] = mod(_gridPos[i] + by, _length);
+        }
+        return *this;
+    }
+
+    // Mirror the positions within the span of the target notes.
+    PatternTransform& reverse(){
+        if(_gridPos.empty()) return *this;
+        auto mm = std::minmax_element(_gridPos.begin(), _gridPos.end());
+        Duration sum = *mm.first + *mm.second;
+        for(size_t i = 0; i < _gridPos.size(); ++i){
+            _gridPos[i] = sum - _gridPos[i];
+            _nudge[i] = -_nudge[i];
+        }
+        return *this;
+    }
+
+    /**
+     * Re-map the notes on 1/fromDiv beat grid onto 1/toDiv beat grid, e.g. 4 -> 5 makes 16th note steps into quintuplet steps.
+     * Exact, as BEAT4 is divisible by all the supported divisions.
+     * If the notes are stretched beyond the loop end, the loop is extended by bars rather than wrapping them onto the notes at the start.
+     */
+    PatternTransform& timeScale(int fromDiv, int toDiv){
+        for(size_t i = 0; i < _gridPos.size(); ++i){
+            _gridPos[i] = _gridPos[i] * fromDiv / toDiv;
+            _duration[i] = jmax(Durations::TICK, _duration[i] * fromDiv / toDiv);
+            if(_gridPos[i] >= _length) _length = (_gridPos[i] / Durations::BEAT1 + 1) * Durations::BEAT1;
+        }
+        return *this;
+    }
+
+    PatternTransform& scaleVelocity(float factor){
+        for(size_t i = 0; i < _vel.size(); ++i){
+            _vel[i] = (int)::round(_vel[i] * factor);
+        }
+        return *this;
+    }
+
+    // Pull the velocities toward their average. amount = 1 makes all the same, 0 keeps as is.
+    PatternTransform& compressVelocity(float amount){
+        if(_vel.empty()) return *this;
+        float avg = (float)std::accumulate(_vel.begin(), _vel.end(), 0) / _vel.size();
+        for(size_t i = 0; i < _vel.size(); ++i){
+            _vel[i] = (int)::round(_vel[i] + (avg - _vel[i]) * amount);
+        }
+        return *this;
+    }
+
+    PatternTransform& randomizeVelocity(int range, Random& rnd = Random::getSystemRandom()){
+        for(size_t i = 0; i < _vel.size(); ++i){
+            _vel[i] += rnd.nextInt(2 * range + 1) - range;
+        }
+        return *this;
+    }
+
+    /**
+     * Move the actual timing toward the nearest grid (per lane / beat division is applied) by strength (0 - 1).
+     * The note is put on the grid, and the rest is kept as nudge.
+     * If the rest does not fit in the nudge range, the note keeps its grid position instead, so that it never moves further than the strength.
+     */
+    PatternTransform& quantize(float strength){
+        const SequenceDrummer::Sequence& seq = _sd.getSequence();
+        const Duration minNudge = InternalParam::minNudge*Durations::TICK, maxNudge = InternalParam::maxNudge*Durations::TICK;
+        for(size_t i = 0; i < _gridPos.size(); ++i){
+            Duration pos = _gridPos[i] + _nudge[i];
+            Duration target = seq.snapToGrid(pos, _note[i]);
+            Duration newPos = pos - (Duration)::round((pos - target) * strength);
+            
+            // Grid position which holds newPos within the nudge range, the target first. Otherwise the nearest possible one.
+            Duration best = target;
+            Duration bestError = std::numeric_limits<Duration>::max();
+            for(Duration gridPos : {target, _gridPos[i]}){
+                Duration nudge = jlimit(minNudge, maxNudge, newPos - gridPos);
+                Duration error = std::abs(gridPos + nudge - newPos);
+                if(error < bestError){
+                    best = gridPos;
+                    bestError = error;
+                }
+            }
+            _nudge[i] = jlimit(minNudge, maxNudge, newPos - best);
+            _gridPos[i] = best;
+        }
+        return *this;
+    }
+
+    /**
+     * Write back all the changes as a single transaction.
+     * Values are limited to the valid range here, rather than in each operation.
+     */
+    void commit(){
+        SequenceDrummer::Sequence::Transaction tr = _sd.getSequence().begin();
+        for(size_t i = 0; i < _handle.size(); ++i){
+            SequenceDrummer::SequenceEntry e;
+            e._note = jlimit(0, 127, _note[i]);
+            e._nudge = jlimit(InternalParam::minNudge*Durations::TICK, InternalParam::maxNudge*Durations::TICK, _nudge[i]);
+            e._pos = mod(_gridPos[i], _length) + e._nudge;
+            e._duration = _duration[i];
+            e._vel = (uint8)jlimit(1, 127, _vel[i]);
+            tr.update(_handle[i], e);
+        }
+        tr.setLength(_length);
+        tr.commit();
+        _sd.fixSelection();
+        _sd.notifySelectionUpdate();
+    }
+
+    /**
+     * Double the loop length, and copy the audible pattern (notes before the loop end) into the new half.
+     * Notes hidden behind the loop end are shifted by the old length, so that they stay hidden instead of overlapping the copy.
+     * Single transaction, i.e. the length is restored by the same undo step as the notes.
+     */
+    static void duplicateLoop(SequenceDrummer& sd){
+        SequenceDrummer::Sequence& seq = sd.getSequence();
+        const SequenceDrummer::SeqStorage& storage = seq.getStorage();
+        Duration length = seq.getLength();
+        size_t end = storage.lowerBound(length);
+
+        SequenceDrummer::Sequence::Transaction tr = seq.begin();
+        for(size_t i = 0; i < storage.size(); ++i){
+            SequenceDrummer::SequenceEntry e = storage.entryAt(i);
+            e._pos += length;
+            if(i < end) tr.insert(e);
+            else tr.update(storage.handleAt(i), e);
+        }
+        tr.setLength(length * 2);
+        tr.commit();
+        sd.fixSelection();
+        sd.notifyChanges();
+    }
+};
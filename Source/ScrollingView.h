@@ -11,6 +11,11 @@
 #pragma once
 
 
+/**
+ * Horizontal scroll over a virtual canvas.
+ * The scrolling container is kept at the viewport size, i.e. it is not sized to the content width however long the pattern or high the zoom is.
+ * scrollViewPaint is given the graphics in the content coordinate, and the children follow the scroll by scrolled().
+ */
 class HScrollingView : public Component, public ScrollBar::Listener{
     class ScrolledViewH : public Component{
         HScrollingView& _parent;
@@ -18,11 +23,13 @@ class HScrollingView : public Component, public ScrollBar::Listener{
         ScrolledViewH(HScrollingView& parent) : _parent(parent){}
         virtual ~ScrolledViewH(){}
         virtual void paint(Graphics& g) override {
+            g.setOrigin(-_parent.getScrollX(), 0);
             _parent.scrollViewPaint(g);
         }
         JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ScrolledViewH)
     };
     Component::SafePointer<ScrolledViewH> _scrollingContainer;
+    int _scrollX = 0;
 public:
     ScrollBar& _hScrollBar;
     HScrollingView(ScrollBar& hScrollBar) : _hScrollBar(hScrollBar){
@@ -39,12 +46,21 @@ public:
     
     Component* getScolloingContainer(){ return _scrollingContainer.getComponent(); }
     
+    // Content x of the left edge of the viewport.
+    int getScrollX() const { return _scrollX; }
+    Point<int> toContent(Point<int> local) const { return local.translated(_scrollX, 0); }
+    
     virtual void scrollBarMoved (ScrollBar* scrollBarThatHasMoved,
                                  double newRangeStart) override
     {
-        _scrollingContainer->setTopLeftPosition( -newRangeStart, 0);
+        int x = roundToInt(newRangeStart);
+        if(x == _scrollX) return;
+        _scrollX = x;
+        scrolled();
+        _scrollingContainer->repaint();
     }
     
+    virtual void scrolled() {}
     virtual void scrollViewPaint(Graphics& g) {}
     
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (HScrollingView)
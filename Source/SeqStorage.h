@@ -0,0 +1,627 @@
+/*
+  ==============================================================================
+
+    SeqStorage.h
+    Created: 19 Oct 2026 10:12:31am
+    Author:  Hiroyuki Baba
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Common.h"
+#include "GridTable.h"
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <limits>
+#include <array>
+
+struct SequenceEntry{
+    int _note;
+    Duration _pos;
+    Duration _nudge; // Slight timing variance less than 64-th note. _pos shall always include this value(hence it represetns the actual timing of the note), while _nudge is the separated info to judge the on-grid / off-grid property. _pos - _nudge is the value used for on-grid/off-grid property.
+    Duration _duration;
+    uint8 _vel;
+
+    bool operator<(const SequenceEntry& rh) const {
+        return _pos < rh._pos;
+    }
+    bool operator==(const SequenceEntry& rh) const {
+        return _note == rh._note && _pos == rh._pos && _nudge == rh._nudge && _duration == rh._duration && _vel == rh._vel;
+    }
+    bool operator!=(const SequenceEntry& rh) const { return !(*this == rh); }
+};
+
+/**
+ * Stable reference to a note in SeqStorage.
+ * It survives any re-ordering of the storage, and becomes invalid(never dangling) once the note is erased, even if the slot is reused by another note.
+ */
+struct NoteHandle{
+    uint32 _index = 0xffffffff;
+    uint32 _generation = 0;
+
+    bool isNull() const { return _index == 0xffffffff; }
+    bool operator==(const NoteHandle& rh) const { return _index == rh._index && _generation == rh._generation; }
+    bool operator!=(const NoteHandle& rh) const { return !(*this == rh); }
+};
+
+/**
+ * Compact record of the changes made by a batch, replayed forward (redo) or backward (undo).
+ * Erased notes are restored with the same handle, hence the handles in the other deltas stay valid.
+ */
+struct SeqDelta{
+    enum OpType{
+        INSERTED = 0,
+        ERASED,
+        UPDATED
+    };
+    struct Op{
+        OpType _type;
+        NoteHandle _handle;
+        SequenceEntry _before; // Not used for INSERTED
+        SequenceEntry _after; // Not used for ERASED
+    };
+    std::vector<Op> _ops;
+    // Loop length change made in the same step. Not applied by SeqStorage (the length is owned by the sequence).
+    Duration _lengthBefore = 0;
+    Duration _lengthAfter = 0;
+    
+    bool hasLengthChange() const { return _lengthBefore != _lengthAfter; }
+    bool empty() const { return _ops.empty() && !hasLengthChange(); }
+};
+
+/**
+ * Declarative filter of notes, evaluated by SeqStorage::select() in one scan over the columns.
+ * All the conditions are AND-ed, and the default one matches all the notes.
+ */
+struct NoteQuery{
+    enum GridCond{
+        GRID_ANY = 0,
+        GRID_ON,
+        GRID_OFF
+    };
+    uint64 _pitches[2] = { ~uint64(0), ~uint64(0) }; // Bit per pitch
+    bool _pitchFiltered = false;
+    int _velMin = 0, _velMax = 127; // Inclusive
+    Duration _posFrom = std::numeric_limits<Duration>::min(), _posTo = std::numeric_limits<Duration>::max(); // [from, to) of _pos
+    Duration _nudgeMin = std::numeric_limits<Duration>::min(), _nudgeMax = std::numeric_limits<Duration>::max(); // Inclusive
+    GridCond _grid = GRID_ANY;
+    
+    // Pitches are accumulated, e.g. pitch(36).pitch(38) matches both.
+    NoteQuery& pitch(int note){
+        if(!_pitchFiltered){
+            _pitches[0] = _pitches[1] = 0;
+            _pitchFiltered = true;
+        }
+        _pitches[(note >> 6) & 1] |= uint64(1) << (note & 63);
+        return *this;
+    }
+    NoteQuery& velocity(int lo, int hi){ _velMin = lo; _velMax = hi; return *this; }
+    NoteQuery& time(Duration from, Duration to){ _posFrom = from; _posTo = to; return *this; }
+    NoteQuery& nudge(Duration lo, Duration hi){ _nudgeMin = lo; _nudgeMax = hi; return *this; }
+    NoteQuery& onGrid(){ _grid = GRID_ON; return *this; }
+    NoteQuery& offGrid(){ _grid = GRID_OFF; return *this; }
+};
+
+/**
+ * Slot map of notes.
+ * Note data is held in the columns indexed by slot, which never move while the note is alive.
+ * Time order is kept separately as the array of slots sorted by _pos (notes with the same _pos are kept in insertion order),
+ * hence moving a note is a position update plus a re-sort of the order array, without any heap free / alloc.
+ * The order array is also bucketed per bar (BEAT1), so that a time window is located by the bucket of its bar and a search within it,
+ * i.e. the cost does not grow with the length of the sequence.
+ * For the hit testing in the editor, slots are also indexed per pitch in the order of the grid position (_pos - _nudge).
+ * The index is updated in place by the single note operations, and the touched pitches are re-built once by the batches.
+ */
+class SeqStorage
+{
+public:
+    SeqStorage() : _maxDuration(0) {
+        _pitchMaxDuration.fill(0);
+        _pitchDirty[0] = _pitchDirty[1] = 0;
+    }
+
+    // Iterates handles in time order
+    class const_iterator{
+        const SeqStorage* _s;
+        size_t _i;
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef NoteHandle value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const NoteHandle* pointer;
+        typedef NoteHandle reference;
+        
+        const_iterator(const SeqStorage* s, size_t i) : _s(s), _i(i) {}
+        NoteHandle operator*() const { return _s->handleAt(_i); }
+        const_iterator& operator++(){ ++_i; return *this; }
+        bool operator==(const const_iterator& rh) const { return _i == rh._i; }
+        bool operator!=(const const_iterator& rh) const { return _i != rh._i; }
+    };
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, _order.size()); }
+
+    size_t size() const { return _order.size(); }
+    bool empty() const { return _order.empty(); }
+
+    void clear(){
+        _note.clear(); _pos.clear(); _nudge.clear(); _duration.clear(); _vel.clear();
+        _gridMask.clear();
+        for(uint32 g : _generation) _generationBase = jmax(_generationBase, g + 1);
+        _generation.clear();
+        _live.clear();
+        _freeSlots.clear();
+        _order.clear();
+        _barFirst.clear();
+        _maxDuration = 0;
+        for(std::vector<uint32>& v : _byPitch) v.clear();
+        _pitchMaxDuration.fill(0);
+        _pitchDirty[0] = _pitchDirty[1] = 0;
+        _retired.clear();
+        _dirty.clear();
+        _reorder.clear();
+    }
+
+    bool isValid(NoteHandle h) const {
+        return h._index < _generation.size() && _generation[h._index] == h._generation;
+    }
+
+    SequenceEntry get(NoteHandle h) const { return getSlot(h._index); }
+
+    // i-th note in time order
+    NoteHandle handleAt(size_t i) const { return {_order[i], _generation[_order[i]]}; }
+    SequenceEntry entryAt(size_t i) const { return getSlot(_order[i]); }
+    Duration posAt(size_t i) const { return _pos[_order[i]]; }
+    
+    // Cached grid membership of the grid position (_pos - _nudge). Kept up to date on every write, so that no division is needed on read.
+    GridTable::Mask gridMask(NoteHandle h) const { return _gridMask[h._index]; }
+    GridTable::Mask gridMaskAt(size_t i) const { return _gridMask[_order[i]]; }
+
+    // Upper bound of the note duration, for the window queries which need the notes started before the window. Exact after the batch.
+    Duration maxDuration() const { return _maxDuration; }
+    
+    // Bar bucket of the position. Notes before the loop start (negative nudge) belong to bar 0.
+    static size_t barOf(Duration pos){ return pos < 0 ? 0 : (size_t)(pos / barLength); }
+    
+    // Notes in the bar are [barBegin(bar), barEnd(bar)) in time order.
+    size_t barCount() const { return _barFirst.size(); }
+    size_t barBegin(size_t bar) const { return bar < _barFirst.size() ? _barFirst[bar] : _order.size(); }
+    size_t barEnd(size_t bar) const { return bar + 1 < _barFirst.size() ? _barFirst[bar+1] : _order.size(); }
+
+    // Same as std::lower_bound / std::upper_bound, but returns the index in time order. Searched only within the bar of pos.
+    size_t lowerBound(Duration pos) const {
+        size_t bar = barOf(pos);
+        if(bar >= _barFirst.size()) return _order.size();
+        return std::lower_bound(_order.begin() + barBegin(bar), _order.begin() + barEnd(bar), pos, [this](uint32 slot, Duration p){ return _pos[slot] < p; }) - _order.begin();
+    }
+    size_t upperBound(Duration pos) const {
+        size_t bar = barOf(pos);
+        if(bar >= _barFirst.size()) return _order.size();
+        return std::upper_bound(_order.begin() + barBegin(bar), _order.begin() + barEnd(bar), pos, [this](Duration p, uint32 slot){ return p < _pos[slot]; }) - _order.begin();
+    }
+
+    /**
+     * Visit the notes of the pitch whose grid span [_pos - _nudge, _pos - _nudge + _duration] intersects [from, to], in the order of the grid position.
+     * f(NoteHandle) returns true to stop. Returns true if stopped.
+     * Cost is a binary search plus the notes started within the max duration of the pitch before the range.
+     */
+    template<class F>
+    bool forEachInSpan(int note, Duration from, Duration to, F f) const {
+        const std::vector<uint32>& v = _byPitch[note & 0x7f];
+        auto it = std::lower_bound(v.begin(), v.end(), from - _pitchMaxDuration[note & 0x7f], [this](uint32 slot, Duration p){ return gridPosOf(slot) < p; });
+        for(; it != v.end() && gridPosOf(*it) <= to; ++it){
+            if(gridPosOf(*it) + _duration[*it] < from) continue;
+            if(f(handleOfSlot(*it))) return true;
+        }
+        return false;
+    }
+
+    NoteHandle insert(const SequenceEntry& e){
+        uint32 slot = allocateSlot();
+        setSlot(slot, e);
+        _order.insert(_order.begin() + upperBound(e._pos), slot);
+        barInserted(barOf(e._pos));
+        pitchInserted(slot);
+        return {slot, _generation[slot]};
+    }
+
+    void erase(NoteHandle h){
+        if(!isValid(h)) return;
+        pitchErased(h._index);
+        _order.erase(_order.begin() + orderIndexOf(h._index));
+        barErased(barOf(_pos[h._index]));
+        ++_generation[h._index]; // Invalidate all the handles to this slot
+        _live[h._index] = 0;
+        _freeSlots.push_back(h._index);
+    }
+
+    // Bit per slot, i.e. indexed by NoteHandle::_index.
+    class Bitmap{
+        std::vector<uint64> _words;
+        friend class SeqStorage;
+    public:
+        bool test(uint32 slot) const { return (slot >> 6) < _words.size() && ((_words[slot >> 6] >> (slot & 63)) & 1); }
+        
+        template<class F>
+        void forEach(F f) const {
+            for(size_t w = 0; w < _words.size(); ++w){
+                for(uint64 bits = _words[w]; bits != 0; bits &= bits - 1){
+                    uint32 b = 0;
+                    while(!((bits >> b) & 1)) ++b;
+                    f((uint32)(w * 64 + b));
+                }
+            }
+        }
+    };
+    
+    NoteHandle handleOfSlot(uint32 slot) const { return {slot, _generation[slot]}; }
+    
+    /**
+     * Evaluate the query over all the slots, 64 slots into a word, without branches except for the grid condition.
+     * divisionOf(gridPos, note) gives the effective grid division, and is called only if the grid condition is given.
+     */
+    template<class DivisionOf>
+    void select(const NoteQuery& q, DivisionOf divisionOf, Bitmap& out) const {
+        size_t n = _generation.size();
+        out._words.assign((n + 63) / 64, 0);
+        for(size_t w = 0; w < out._words.size(); ++w){
+            uint64 bits = 0;
+            size_t end = jmin(n, w * 64 + 64);
+            for(size_t slot = w * 64; slot < end; ++slot){
+                int note = _note[slot] & 0x7f;
+                uint64 m = (uint64)_live[slot]
+                    & (q._pitches[note >> 6] >> (note & 63))
+                    & (uint64)(q._velMin <= _vel[slot]) & (uint64)(_vel[slot] <= q._velMax)
+                    & (uint64)(q._posFrom <= _pos[slot]) & (uint64)(_pos[slot] < q._posTo)
+                    & (uint64)(q._nudgeMin <= _nudge[slot]) & (uint64)(_nudge[slot] <= q._nudgeMax);
+                if(m && q._grid != NoteQuery::GRID_ANY){
+                    bool on = GridTable::isOnGrid(_gridMask[slot], divisionOf(_pos[slot] - _nudge[slot], note));
+                    m = on == (q._grid == NoteQuery::GRID_ON);
+                }
+                bits |= m << (slot - w * 64);
+            }
+            out._words[w] = bits;
+        }
+    }
+
+    void update(NoteHandle h, const SequenceEntry& e){
+        if(!isValid(h)) return;
+        bool reindex = e._note != _note[h._index] || e._pos - e._nudge != gridPosOf(h._index);
+        if(reindex) pitchErased(h._index);
+        updateOrder(h, e);
+        if(reindex) pitchInserted(h._index);
+        else _pitchMaxDuration[e._note & 0x7f] = jmax(_pitchMaxDuration[e._note & 0x7f], e._duration);
+    }
+
+    // No need to re-order for these changes.
+    void setDuration(NoteHandle h, Duration d){
+        if(!isValid(h)) return;
+        _duration[h._index] = d;
+        _maxDuration = jmax(_maxDuration, d);
+        _pitchMaxDuration[_note[h._index] & 0x7f] = jmax(_pitchMaxDuration[_note[h._index] & 0x7f], d);
+    }
+    void setVelocity(NoteHandle h, uint8 v){ if(isValid(h)) _vel[h._index] = v; }
+    
+    /**
+     * Set of changes applied at once by apply().
+     * Operations are applied in the order of the call, erases after them, and inserts at last.
+     */
+    struct Batch{
+        enum OpType{
+            OP_UPDATE = 0,
+            OP_DURATION,
+            OP_VELOCITY
+        };
+        struct Op{
+            OpType _type;
+            NoteHandle _handle;
+            SequenceEntry _entry; // Only the field for the _type is valid for OP_DURATION and OP_VELOCITY
+        };
+        std::vector<Op> _ops;
+        std::vector<NoteHandle> _erases;
+        std::vector<SequenceEntry> _inserts;
+        
+        bool empty() const { return _ops.empty() && _erases.empty() && _inserts.empty(); }
+        void clear(){
+            _ops.clear();
+            _erases.clear();
+            _inserts.clear();
+        }
+    };
+    
+    /**
+     * Apply all the changes in the batch with one sorted merge of the order array,
+     * i.e. O(n + k log k) for k moved / inserted notes rather than k separate re-sorts.
+     * Returns the handles of the inserted notes in the order of Batch::_inserts.
+     * If delta is given, the changes are recorded to it for undo / redo, and the erased slots are retired (kept for restore) instead of freed.
+     */
+    std::vector<NoteHandle> apply(const Batch& b, SeqDelta* delta = nullptr){
+        for(const Batch::Op& op : b._ops){
+            if(!isValid(op._handle)) continue;
+            uint32 slot = op._handle._index;
+            SequenceEntry before = getSlot(slot);
+            SequenceEntry after = before;
+            if(op._type == Batch::OP_UPDATE){
+                after = op._entry;
+            }else if(op._type == Batch::OP_DURATION){
+                after._duration = op._entry._duration;
+            }else if(op._type == Batch::OP_VELOCITY){
+                after._vel = op._entry._vel;
+            }
+            if(after == before) continue; // No-op, e.g. a knob re-set to the current value. Not recorded, hence no undo step.
+            pitchTouched(before._note);
+            if(after._pos != before._pos) markPlaced(slot);
+            setSlot(slot, after);
+            pitchTouched(after._note);
+            if(delta) delta->_ops.push_back({SeqDelta::UPDATED, op._handle, before, after});
+        }
+        
+        std::vector<uint32> erased;
+        for(NoteHandle h : b._erases){
+            if(!isValid(h)) continue;
+            if(delta) delta->_ops.push_back({SeqDelta::ERASED, h, getSlot(h._index), getSlot(h._index)});
+            retire(h._index);
+            if(!delta) erased.push_back(h._index);
+        }
+        
+        std::vector<NoteHandle> inserted;
+        inserted.reserve(b._inserts.size());
+        for(const SequenceEntry& e : b._inserts){
+            uint32 slot = allocateSlot();
+            setSlot(slot, e);
+            markPlaced(slot);
+            pitchTouched(e._note);
+            inserted.push_back({slot, _generation[slot]});
+            if(delta) delta->_ops.push_back({SeqDelta::INSERTED, inserted.back(), e, e});
+        }
+        
+        finishReorder();
+        rebuildPitches();
+        
+        // Erased slots can be reused from the next time
+        for(uint32 slot : erased) release(slot);
+        return inserted;
+    }
+    
+    /**
+     * Replay the recorded delta forward (redo) or backward (undo) with one sorted merge.
+     * Handles in the delta stay the same, as the erased notes are restored into their retired slots.
+     */
+    void applyDelta(const SeqDelta& d, bool forward){
+        for(size_t n = 0; n < d._ops.size(); ++n){
+            const SeqDelta::Op& op = d._ops[forward ? n : d._ops.size() - 1 - n];
+            bool toLive = (op._type == SeqDelta::INSERTED) == forward;
+            if(op._type == SeqDelta::UPDATED){
+                if(!isValid(op._handle)) continue;
+                const SequenceEntry& e = forward ? op._after : op._before;
+                if(e._pos != _pos[op._handle._index]) markPlaced(op._handle._index);
+                pitchTouched(_note[op._handle._index]);
+                setSlot(op._handle._index, e);
+                pitchTouched(e._note);
+            }else if(toLive){
+                restore(op._handle, op._after);
+            }else{
+                if(!isValid(op._handle)) continue;
+                retire(op._handle._index);
+            }
+        }
+        finishReorder();
+        rebuildPitches();
+    }
+    
+    /**
+     * Release the retired slots of the handles, so that they can be reused. Handles which are not retired are ignored.
+     * Call this when the delta which can restore them is discarded.
+     */
+    void releaseRetired(const std::vector<NoteHandle>& handles){
+        for(NoteHandle h : handles){
+            if(h._index < _retired.size() && _retired[h._index] && _generation[h._index] == h._generation + 1) release(h._index);
+        }
+    }
+
+private:
+    // Columns indexed by slot
+    std::vector<int> _note;
+    std::vector<Duration> _pos;
+    std::vector<Duration> _nudge;
+    std::vector<Duration> _duration;
+    std::vector<uint8> _vel;
+    std::vector<GridTable::Mask> _gridMask;
+    std::vector<uint32> _generation;
+    uint32 _generationBase = 0; // Generation of a new slot. Raised by clear(), so that no handle from before clear() becomes valid again.
+    std::vector<uint8> _live; // 1 if the slot holds a note in the order
+
+    std::vector<uint32> _freeSlots;
+    std::vector<uint32> _order; // Live slots sorted by _pos
+    std::vector<uint32> _barFirst; // [bar] : index in _order of the first note at or after the bar start. Covers up to the bar of the last note.
+    static constexpr Duration barLength = Durations::BEAT1;
+    Duration _maxDuration; // Grows on write, and re-computed on rebuildBars()
+    std::array<std::vector<uint32>, 128> _byPitch; // Live slots per pitch sorted by the grid position
+    std::array<Duration, 128> _pitchMaxDuration; // Grows on write, and re-computed on rebuildPitches() for the touched pitches
+    uint64 _pitchDirty[2]; // Pitches touched by the current batch
+    std::vector<uint8> _retired; // Erased slots which are kept for restore, not in _freeSlots.
+    
+    // Work area for the bulk re-order. All 0 / empty outside apply() and applyDelta().
+    enum{ DIRTY_PLACE = 1, DIRTY_REMOVE = 2 };
+    std::vector<uint8> _dirty;
+    std::vector<uint32> _reorder; // Slots to be (re-)placed in the order array
+    
+    uint32 allocateSlot(){
+        if(_freeSlots.size() > 0){
+            uint32 slot = _freeSlots.back();
+            _freeSlots.pop_back();
+            _live[slot] = 1;
+            return slot;
+        }
+        _note.push_back(0); _pos.push_back(0); _nudge.push_back(0); _duration.push_back(0); _vel.push_back(0);
+        _gridMask.push_back(GridTable::membership(0)); // Mask is always consistent with the (_pos - _nudge) of the slot
+        _generation.push_back(_generationBase);
+        _live.push_back(1);
+        _retired.push_back(0);
+        return (uint32)_generation.size() - 1;
+    }
+    
+    void markPlaced(uint32 slot){
+        if(slot >= _dirty.size()) _dirty.resize(_generation.size(), 0);
+        _dirty[slot] &= ~DIRTY_REMOVE;
+        if(!(_dirty[slot] & DIRTY_PLACE)){
+            _dirty[slot] |= DIRTY_PLACE;
+            _reorder.push_back(slot);
+        }
+    }
+    void markRemoved(uint32 slot){
+        if(slot >= _dirty.size()) _dirty.resize(_generation.size(), 0);
+        _dirty[slot] |= DIRTY_REMOVE;
+    }
+    
+    // Invalidate all the handles to this slot, and take it out of the order. Slot is not reusable until release().
+    void retire(uint32 slot){
+        pitchTouched(_note[slot]);
+        ++_generation[slot];
+        _retired[slot] = 1;
+        _live[slot] = 0;
+        markRemoved(slot);
+    }
+    void restore(NoteHandle h, const SequenceEntry& e){
+        if(!(h._index < _retired.size() && _retired[h._index] && _generation[h._index] == h._generation + 1)){
+            jassertfalse; // Slot was released or reused
+            return;
+        }
+        _generation[h._index] = h._generation;
+        _retired[h._index] = 0;
+        _live[h._index] = 1;
+        setSlot(h._index, e);
+        markPlaced(h._index);
+        pitchTouched(e._note);
+    }
+    void release(uint32 slot){
+        _retired[slot] = 0;
+        _freeSlots.push_back(slot);
+    }
+    
+    // Remove all the marked slots with single pass, then merge the placed ones back.
+    // Stable, so that the notes kept in the order come first among the same _pos.
+    void finishReorder(){
+        if(_dirty.empty()) return;
+        _order.erase(std::remove_if(_order.begin(), _order.end(), [this](uint32 slot){ return slot < _dirty.size() && _dirty[slot] != 0; }), _order.end());
+        _reorder.erase(std::remove_if(_reorder.begin(), _reorder.end(), [this](uint32 slot){ return (_dirty[slot] & DIRTY_REMOVE) != 0; }), _reorder.end());
+        std::stable_sort(_reorder.begin(), _reorder.end(), [this](uint32 l, uint32 r){ return _pos[l] < _pos[r]; });
+        size_t mid = _order.size();
+        _order.insert(_order.end(), _reorder.begin(), _reorder.end());
+        std::inplace_merge(_order.begin(), _order.begin() + mid, _order.end(), [this](uint32 l, uint32 r){ return _pos[l] < _pos[r]; });
+        _reorder.clear();
+        _dirty.clear();
+        rebuildBars();
+    }
+    
+    void rebuildBars(){
+        _barFirst.clear();
+        _maxDuration = 0;
+        for(size_t i = 0; i < _order.size(); ++i){
+            size_t bar = barOf(_pos[_order[i]]);
+            while(_barFirst.size() <= bar) _barFirst.push_back((uint32)i);
+            _maxDuration = jmax(_maxDuration, _duration[_order[i]]);
+        }
+    }
+    // Keep the bar buckets after a single note is put into / taken from / moved between the bars. The order array is already updated.
+    void barInserted(size_t bar){
+        while(_barFirst.size() <= bar) _barFirst.push_back((uint32)_order.size() - 1); // The note is the last one, and the new bars start from it.
+        for(size_t b = bar + 1; b < _barFirst.size(); ++b) ++_barFirst[b];
+    }
+    void barErased(size_t bar){
+        for(size_t b = bar + 1; b < _barFirst.size(); ++b) --_barFirst[b];
+    }
+    // Only the bars in between are shifted, as the cost of the move itself.
+    void barMoved(size_t fromBar, size_t toBar){
+        if(fromBar < toBar){
+            for(size_t b = fromBar + 1; b <= toBar && b < _barFirst.size(); ++b) --_barFirst[b];
+            while(_barFirst.size() <= toBar) _barFirst.push_back((uint32)_order.size() - 1);
+        }else{
+            for(size_t b = toBar + 1; b <= fromBar; ++b) ++_barFirst[b];
+        }
+    }
+
+    // Move within the order array and the bar buckets. Pitch index is up to the caller.
+    void updateOrder(NoteHandle h, const SequenceEntry& e){
+        if(e._pos == _pos[h._index]){
+            setSlot(h._index, e);
+            return;
+        }
+        // Rotate the slot in the order array from the old index to the new one. Cost is proportional to the distance of the move.
+        size_t from = orderIndexOf(h._index);
+        size_t fromBar = barOf(_pos[h._index]);
+        setSlot(h._index, e);
+        if(from + 1 < _order.size() && _pos[_order[from+1]] <= e._pos){
+            size_t to = std::upper_bound(_order.begin() + from + 1, _order.end(), e._pos, [this](Duration p, uint32 slot){ return p < _pos[slot]; }) - _order.begin();
+            std::rotate(_order.begin() + from, _order.begin() + from + 1, _order.begin() + to);
+        }else if(from > 0 && e._pos < _pos[_order[from-1]]){
+            size_t to = std::upper_bound(_order.begin(), _order.begin() + from, e._pos, [this](Duration p, uint32 slot){ return p < _pos[slot]; }) - _order.begin();
+            std::rotate(_order.begin() + to, _order.begin() + from, _order.begin() + from + 1);
+        }
+        barMoved(fromBar, barOf(e._pos));
+    }
+    
+    Duration gridPosOf(uint32 slot) const { return _pos[slot] - _nudge[slot]; }
+    
+    // Single note operations : the slot is put into / taken from its pitch with a binary search.
+    void pitchInserted(uint32 slot){
+        int note = _note[slot] & 0x7f;
+        std::vector<uint32>& v = _byPitch[note];
+        v.insert(std::upper_bound(v.begin(), v.end(), gridPosOf(slot), [this](Duration p, uint32 s){ return p < gridPosOf(s); }), slot);
+        _pitchMaxDuration[note] = jmax(_pitchMaxDuration[note], _duration[slot]);
+    }
+    void pitchErased(uint32 slot){
+        std::vector<uint32>& v = _byPitch[_note[slot] & 0x7f];
+        auto it = std::lower_bound(v.begin(), v.end(), gridPosOf(slot), [this](uint32 s, Duration p){ return gridPosOf(s) < p; });
+        while(it != v.end() && *it != slot) ++it;
+        if(it != v.end()) v.erase(it);
+    }
+    // Batches : the touched pitches are re-built at the end, with one pass over the order array.
+    void pitchTouched(int note){
+        note &= 0x7f;
+        _pitchDirty[note >> 6] |= uint64(1) << (note & 63);
+    }
+    void rebuildPitches(){
+        if((_pitchDirty[0] | _pitchDirty[1]) == 0) return;
+        auto dirty = [this](int note){ return (_pitchDirty[note >> 6] >> (note & 63)) & 1; };
+        for(int note = 0; note < 128; ++note){
+            if(!dirty(note)) continue;
+            _byPitch[note].clear();
+            _pitchMaxDuration[note] = 0;
+        }
+        for(uint32 slot : _order){
+            int note = _note[slot] & 0x7f;
+            if(!dirty(note)) continue;
+            _byPitch[note].push_back(slot);
+            _pitchMaxDuration[note] = jmax(_pitchMaxDuration[note], _duration[slot]);
+        }
+        for(int note = 0; note < 128; ++note){
+            if(!dirty(note)) continue;
+            std::vector<uint32>& v = _byPitch[note];
+            std::stable_sort(v.begin(), v.end(), [this](uint32 l, uint32 r){ return gridPosOf(l) < gridPosOf(r); });
+        }
+        _pitchDirty[0] = _pitchDirty[1] = 0;
+    }
+
+    SequenceEntry getSlot(uint32 slot) const {
+        return {_note[slot], _pos[slot], _nudge[slot], _duration[slot], _vel[slot]};
+    }
+    void setSlot(uint32 slot, const SequenceEntry& e){
+        if(e._pos - e._nudge != _pos[slot] - _nudge[slot]) _gridMask[slot] = GridTable::membership(e._pos - e._nudge);
+        _note[slot] = e._note;
+        _pos[slot] = e._pos;
+        _nudge[slot] = e._nudge;
+        _duration[slot] = e._duration;
+        _vel[slot] = e._vel;
+        _maxDuration = jmax(_maxDuration, e._duration);
+    }
+    // Binary search in the notes with the same _pos, then linear search among them.
+    size_t orderIndexOf(uint32 slot) const {
+        size_t i = lowerBound(_pos[slot]);
+        while(_order[i] != slot) ++i;
+        return i;
+    }
+};
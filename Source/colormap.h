@@ -23,4 +23,52 @@ double red( double gray );
 double green( double gray );
 double blue( double gray );
 
+/**
+ * Velocity (0 - 127) to the colour of the note, as packed ARGB (Colour(uint32)). Same as GetColour(v, 0, 127).
+ * _selected is the one brighter(1.0) twice applied. Generated at compile time, so that painting a note needs no double math.
+ */
+struct VelocityColours{
+    unsigned int _normal[128];
+    unsigned int _selected[128];
+};
+
+constexpr unsigned int PackARGB(double r, double g, double b){
+    return 0xff000000u | ((unsigned int)(unsigned char)(r * 255) << 16) | ((unsigned int)(unsigned char)(g * 255) << 8) | (unsigned int)(unsigned char)(b * 255);
+}
+
+// Same as juce::Colour::brighter(1.0) for each component
+constexpr unsigned int Brighter(unsigned int argb){
+    unsigned int ret = argb & 0xff000000u;
+    for(int shift = 0; shift < 24; shift += 8){
+        unsigned int c = (argb >> shift) & 0xff;
+        ret |= (unsigned int)(unsigned char)(255 - (0.5f * (255 - c))) << shift;
+    }
+    return ret;
+}
+
+constexpr VelocityColours MakeVelocityColours(){
+    VelocityColours t{};
+    for(int v = 0; v < 128; ++v){
+        double dv = 127.0;
+        double r = 1.0, g = 1.0, b = 1.0;
+        if (v < 0.25 * dv) {
+            r = 0;
+            g = 4 * v / dv;
+        } else if (v < 0.5 * dv) {
+            r = 0;
+            b = 1 + 4 * (0.25 * dv - v) / dv;
+        } else if (v < 0.75 * dv) {
+            r = 4 * (v - 0.5 * dv) / dv;
+            b = 0;
+        } else {
+            g = 1 + 4 * (0.75 * dv - v) / dv;
+            b = 0;
+        }
+        t._normal[v] = PackARGB(r, g, b);
+        t._selected[v] = Brighter(Brighter(t._normal[v]));
+    }
+    return t;
+}
+constexpr VelocityColours velocityColours = MakeVelocityColours();
+
 }